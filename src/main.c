@@ -1,43 +1,244 @@
 #include "simulation/simulation_core.h"
+#include "simulation/simulation_export.h"
 #include "simulation/simulation_interface.h"
+#include "simulation/simulation_loader.h"
 #include "simulation/simulation_renderer.h"
+#include "simulation/simulation_snapshot.h"
+#include <fcntl.h>
+#include <omp.h>
 #include <raylib.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #define WIDTH 1920
 #define HEIGHT 1080
 #define FPS 60
 
+// Bodies checked against direct summation after --bench
+#define BENCH_ERROR_SAMPLES 1000
+
+// --precision names, indexed by QuadTreePrecision
+const char *precision_names[] = {"exact", "rsqrt1", "rsqrt2"};
+
+// Snapshot stream (--snapshots): max position error and keyframe spacing
+#define SNAPSHOT_ERR_BOUND 0.01f
+#define SNAPSHOT_KEY_INTERVAL 64
+
+// Initial conditions file (--load), a galaxy is generated without one
+const char *ic_path = NULL;
+
 void init_sim(const SimulationCore *core) {
-  sim_init_galaxy(core->bodies, core->params, 0, core->bodies->count, 1e6, 100,
-                  WIDTH/2.0, HEIGHT/2.0, 0, 0, 0.04);
+  if (!ic_path) {
+    sim_init_galaxy(core->bodies, core->params, 0, core->bodies->count, 1e6,
+                    100, WIDTH/2.0, HEIGHT/2.0, 0, 0, 0.04);
+  } else if (core->step_count > 0) {
+    // Reset after stepping, reload the file (it is loaded fresh on start)
+    SimulationCore *sim = (SimulationCore *)core;
+    SimulationParams params = sim->params;
+    BodyData *bodies = sim_load_bodies(ic_path, &params);
+
+    // The export and snapshot streams are sized for the current count
+    if (bodies && bodies->count != sim->bodies->count) {
+      fprintf(stderr, "%s: now holds %d bodies instead of %d, not reloaded\n",
+              ic_path, bodies->count, sim->bodies->count);
+      body_data_destroy(bodies);
+    } else if (bodies) {
+      body_data_destroy(sim->bodies);
+      sim->bodies = bodies;
+    }
+  }
 
   // sim_init_uniform(core->bodies, 0, 200, 0, 200, 2);
   sim_core_init_leapfrog((SimulationCore *)core);
 }
 
-int main(void) {
+void init_view(const SimulationCore *core) {
+  (void)core; // the viewer does not own the simulation, nothing to reset
+}
+
+// Draws frames published by a simulation in another process (--attach)
+int run_viewer(const char *name) {
+  SimExport *exp = sim_export_attach(name);
+  if (!exp) {
+    fprintf(stderr, "%s: no simulation export to attach to\n", name);
+    return 1;
+  }
+
+  // Only used to hold positions for sim_render_frame
+  SimulationParams params = {.body_count = exp->header->body_capacity};
+  SimulationCore *view = sim_core_create(params, 1);
+  view->bodies->count = 0;
+
+  InitWindow(WIDTH, HEIGHT, "N-Body Sim (attached)");
+  SetTargetFPS(FPS);
+
+  Camera2D cam = {0};
+  cam.zoom = 1.0f;
+
+  uint64_t generation = 0;
+  while (!WindowShouldClose()) {
+    SimExportFrameInfo info;
+    if (sim_export_read(exp, generation, view->bodies->x, view->bodies->y,
+                        &info) == 1) {
+      generation = info.generation;
+      view->bodies->count = info.count;
+    }
+
+    sim_render_frame(view, &cam, init_view);
+  }
+
+  CloseWindow();
+  sim_core_destroy(view);
+  sim_export_destroy(exp);
+
+  return 0;
+}
+
+// Runs steps without a window, prints the mean step time and the force
+// error of the last step against direct summation
+void bench_sim(SimulationCore *core, int steps) {
+  double start = omp_get_wtime();
+  for (int i = 0; i < steps; i++) {
+    sim_core_step(core);
+  }
+  double elapsed = omp_get_wtime() - start;
+
+  float error = sim_core_force_error(core, BENCH_ERROR_SAMPLES);
+
+  printf("%d bodies, %d threads, %d places: %.3f ms/step\n",
+         core->bodies->count, omp_get_max_threads(), omp_get_num_places(),
+         elapsed * 1e3 / steps);
+  printf("theta %.3f, err_tol %.4f, dual tree %d, precision %s: "
+         "force error %.3f%%\n",
+         core->params.theta, core->params.err_tol, core->params.dual_tree,
+         precision_names[core->params.precision], error * 100);
+}
+
+int main(int argc, char **argv) {
   SimulationParams params = {.body_count = 60000, 
                              .G = 0.1,
                              .eps = 0.5,
                              .dt = 0.01,
-                             .theta = 0.5};
+                             .theta = 0.5,
+                             .err_tol = 0.005,
+                             .replicate_tree = 1,
+                             .diag_interval = 100,
+                             .export_interval = 1,
+                             .snapshot_interval = 10};
+
+  // Options: --bench <steps>, --theta <angle>, --err-tol <tolerance> (0 uses
+  // theta only), --dual-tree <0|1>, --precision <exact|rsqrt1|rsqrt2>,
+  // --diag <csv path>, --load <initial conditions>, --export <shm name>
+  // (publish frames), --attach <shm name> (view only), --snapshots <path>
+  // (compressed trajectory)
+  int bench_steps = 0;
+  const char *diag_path = NULL;
+  const char *export_name = NULL;
+  const char *snapshot_path = NULL;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--bench") == 0) {
+      bench_steps = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--theta") == 0) {
+      params.theta = atof(argv[i + 1]);
+    } else if (strcmp(argv[i], "--err-tol") == 0) {
+      params.err_tol = atof(argv[i + 1]);
+    } else if (strcmp(argv[i], "--dual-tree") == 0) {
+      params.dual_tree = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--precision") == 0) {
+      int mode = 0;
+      while (mode <= QT_PRECISION_RSQRT2 &&
+             strcmp(argv[i + 1], precision_names[mode]) != 0) {
+        mode++;
+      }
+      if (mode > QT_PRECISION_RSQRT2) {
+        fprintf(stderr, "%s: unknown precision\n", argv[i + 1]);
+        return 1;
+      }
+      params.precision = mode;
+    } else if (strcmp(argv[i], "--diag") == 0) {
+      diag_path = argv[i + 1];
+    } else if (strcmp(argv[i], "--load") == 0) {
+      ic_path = argv[i + 1];
+    } else if (strcmp(argv[i], "--export") == 0) {
+      export_name = argv[i + 1];
+    } else if (strcmp(argv[i], "--snapshots") == 0) {
+      snapshot_path = argv[i + 1];
+    } else if (strcmp(argv[i], "--attach") == 0) {
+      return run_viewer(argv[i + 1]);
+    }
+  }
+
+  SimulationCore *core;
+  if (ic_path) {
+    double start = omp_get_wtime();
+    BodyData *bodies = sim_load_bodies(ic_path, &params);
+    if (!bodies) {
+      return 1;
+    }
+    printf("Loaded %d bodies in %.3f s\n", params.body_count,
+           omp_get_wtime() - start);
+
+    core = sim_core_create_from_bodies(params, bodies, 1024);
+  } else {
+    core = sim_core_create(params, 1024);
+  }
+
+  if (diag_path) {
+    core->diag_fd = open(diag_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (core->diag_fd < 0) {
+      perror(diag_path);
+      return 1;
+    }
+    sim_record_diagnostics_header(core->diag_fd);
+  }
+
+  if (export_name) {
+    core->exporter = sim_export_create(export_name, core->bodies->count, 4);
+    if (!core->exporter) {
+      return 1;
+    }
+  }
+
+  // Kept here as well, the core drops its pointer if a push fails
+  SnapshotWriter *snapshots = NULL;
+  if (snapshot_path) {
+    snapshots = snap_writer_create(snapshot_path, core->bodies->count,
+                                   SNAPSHOT_ERR_BOUND, SNAPSHOT_KEY_INTERVAL);
+    if (!snapshots) {
+      perror(snapshot_path);
+      return 1;
+    }
+    core->snapshots = snapshots;
+  }
 
-  SimulationCore *core = sim_core_create(params, 1024);
   init_sim(core);
 
-  InitWindow(WIDTH, HEIGHT, "N-Body Sim");
-  SetTargetFPS(6000);
+  if (bench_steps > 0) {
+    bench_sim(core, bench_steps);
+  } else {
+    InitWindow(WIDTH, HEIGHT, "N-Body Sim");
+    SetTargetFPS(6000);
 
-  Camera2D cam = {0};
-  cam.zoom = 1.0f;
+    Camera2D cam = {0};
+    cam.zoom = 1.0f;
 
-  while (!WindowShouldClose()) {
-    sim_core_step(core);
-    sim_render_frame(core, &cam, init_sim);
-    printf("FPS: %d\n", GetFPS()); 
+    while (!WindowShouldClose()) {
+      sim_core_step(core);
+      sim_render_frame(core, &cam, init_sim);
+      printf("FPS: %d\n", GetFPS()); 
+    }
+
+    CloseWindow();
   }
 
+  if (core->diag_fd >= 0) {
+    close(core->diag_fd);
+  }
+  sim_export_destroy(core->exporter);
+  if (snapshots) {
+    snap_writer_destroy(snapshots);
+  }
   sim_core_destroy(core);
-  CloseWindow();
 }
@@ -6,13 +6,30 @@ BodyData *body_data_create(int body_count) {
   BodyData *data = malloc(sizeof(BodyData));
   data->count = body_count;
 
-  data->x = calloc(body_count, sizeof(float));
-  data->y = calloc(body_count, sizeof(float));
-  data->vx = calloc(body_count, sizeof(float));
-  data->vy = calloc(body_count, sizeof(float));
-  data->ax = calloc(body_count, sizeof(float));
-  data->ay = calloc(body_count, sizeof(float));
-  data->mass = calloc(body_count, sizeof(float));
+  data->x = malloc(body_count * sizeof(float));
+  data->y = malloc(body_count * sizeof(float));
+  data->vx = malloc(body_count * sizeof(float));
+  data->vy = malloc(body_count * sizeof(float));
+  data->ax = malloc(body_count * sizeof(float));
+  data->ay = malloc(body_count * sizeof(float));
+  data->mass = malloc(body_count * sizeof(float));
+  data->a_mag = malloc(body_count * sizeof(float));
+  data->pot = malloc(body_count * sizeof(float));
+
+  // First touch in parallel with the same static schedule as the simulation
+  // loops, so each page lands on the NUMA node of the thread that uses it
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < body_count; i++) {
+    data->x[i] = 0;
+    data->y[i] = 0;
+    data->vx[i] = 0;
+    data->vy[i] = 0;
+    data->ax[i] = 0;
+    data->ay[i] = 0;
+    data->mass[i] = 0;
+    data->a_mag[i] = 0;
+    data->pot[i] = 0;
+  }
 
   return data;
 }
@@ -26,6 +43,8 @@ void body_data_destroy(BodyData *data) {
     free(data->ax);
     free(data->ay);
     free(data->mass);
+    free(data->a_mag);
+    free(data->pot);
     free(data);
   }
 }
@@ -9,6 +9,8 @@ typedef struct BodyData {
   float *ax;   // x accelerations
   float *ay;   // y accelerations
   float *mass; // masses
+  float *a_mag; // |a| from the previous force evaluation
+  float *pot;   // potential per unit mass (only on diagnostic steps)
   int count;   // number of bodies
 } BodyData;
 
@@ -1,7 +1,29 @@
 #ifndef HELPER_FUNCS_H
 #define HELPER_FUNCS_H
 
+#ifdef __SSE__
+#include <immintrin.h>
+#else
+#include <stdint.h>
+#include <string.h>
+#endif
+
 float gaussian_random();
-float fast_inv_sqrt(float x);
+
+// Approximate 1 / sqrt(x): hardware rsqrt estimate (bit trick without SSE)
+// refined by one Newton-Raphson step. Inline as it sits in the force walk.
+static inline float fast_inv_sqrt(float x) {
+#ifdef __SSE__
+  float r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+#else
+  uint32_t i;
+  memcpy(&i, &x, sizeof(i));
+  i = 0x5f3759df - (i >> 1);
+  float r;
+  memcpy(&r, &i, sizeof(r));
+#endif
+
+  return r * (1.5f - 0.5f * x * r * r);
+}
 
 #endif
@@ -1,7 +1,16 @@
 #include "quadtree.h"
+#include "helper_funcs.h"
 #include <math.h>
+#include <omp.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+// Target subtrees deeper than this are walked inside their parent's task
+#define QT_DUAL_TASK_DEPTH 6
+
+// Subtrees deeper than this are propagated inside their parent's task
+#define QT_PROPAGATE_TASK_DEPTH 4
 
 // Helper function prototypes
 int qt_get_child(QuadTreeNode *node, float x, float y);
@@ -12,6 +21,19 @@ QuadTreeError qt_add_parent(QuadTree *qt, int parent_idx);
 
 QuadTreeError qt_subdivide(QuadTree *qt, QuadTreeNode *node);
 
+void qt_drop_replicas(QuadTree *qt);
+
+void qt_propagate_parent(QuadTree *qt, int parent_idx);
+
+void qt_propagate_subtree(QuadTree *qt, int idx, int depth);
+
+QuadTreeError qt_replicate_team(QuadTree *qt, int place_count);
+
+void qt_dual_interact(QuadTree *qt, int t_idx, int s_idx, float theta2,
+                      float eps2, float G, int depth);
+
+static inline float qt_inv_dist(float dist2, QuadTreePrecision precision);
+
 QuadTree *qt_create(int node_capacity) {
   QuadTree *ret = malloc(sizeof(QuadTree));
   if (!ret) {
@@ -35,6 +57,19 @@ QuadTree *qt_create(int node_capacity) {
   ret->parent_count = 0;
   ret->parent_capacity = parent_capacity;
 
+  // Allocated on the first qt_dual_walk
+  ret->locals = NULL;
+  ret->local_capacity = 0;
+  ret->leaf_pot = 0;
+
+  ret->precision = QT_PRECISION_EXACT;
+
+  // Allocated on the first qt_replicate
+  ret->replicas = NULL;
+  ret->replica_claimed = NULL;
+  ret->replica_count = 0;
+  ret->replica_capacity = 0;
+
   return ret;
 }
 
@@ -45,6 +80,12 @@ QuadTreeError qt_destroy(QuadTree *qt) {
 
   free(qt->nodes);
   free(qt->parents);
+  free(qt->locals);
+  for (int i = 0; i < qt->replica_count; i++) {
+    free(qt->replicas[i]);
+  }
+  free(qt->replicas);
+  free(qt->replica_claimed);
   free(qt);
 
   return QT_SUCCESS;
@@ -154,51 +195,96 @@ QuadTreeError qt_insert(QuadTree *qt, float x, float y, float mass) {
   return QT_SUCCESS;
 }
 
+// Inside a parallel region subtrees are combined in OpenMP tasks; call it
+// from a single thread (e.g. omp single) so the others run the tasks.
 QuadTreeError qt_propagate(QuadTree *qt) {
   if (!qt) {
     return QT_INVALID_POINTER;
   }
 
-  QuadTreeNode *parent;
+  if (omp_in_parallel()) {
+    qt_propagate_subtree(qt, 0, 0);
+    return QT_SUCCESS;
+  }
+
+  // Parents are ordered top to bottom, so children are done first
   for (int i = qt->parent_count - 1; i >= 0; i--) {
-    parent = &qt->nodes[qt->parents[i]];
+    qt_propagate_parent(qt, qt->parents[i]);
+  }
 
-    float x1 = qt->nodes[parent->first_child].c_x;
-    float y1 = qt->nodes[parent->first_child].c_y;
-    float m1 = qt->nodes[parent->first_child].mass;
+  return QT_SUCCESS;
+}
 
-    float x2 = qt->nodes[parent->first_child + 1].c_x;
-    float y2 = qt->nodes[parent->first_child + 1].c_y;
-    float m2 = qt->nodes[parent->first_child + 1].mass;
+QuadTreeError qt_acc(QuadTree *qt, float x, float y, float mass, float theta,
+                     float eps, float G, float *ax, float *ay, float *pot) {
+  if (!qt) {
+    return QT_INVALID_POINTER;
+  }
 
-    float x3 = qt->nodes[parent->first_child + 2].c_x;
-    float y3 = qt->nodes[parent->first_child + 2].c_y;
-    float m3 = qt->nodes[parent->first_child + 2].mass;
+  *ax = 0;
+  *ay = 0;
+  float phi = 0; // potential, only stored when pot is given
 
-    float x4 = qt->nodes[parent->first_child + 3].c_x;
-    float y4 = qt->nodes[parent->first_child + 3].c_y;
-    float m4 = qt->nodes[parent->first_child + 3].mass;
+  float theta2 = theta * theta;
+  float eps2 = eps * eps;
 
-    float total_mass = m1 + m2 + m3 + m4;
+  int curr_idx = 0;
+  while (1) {
+    QuadTreeNode *curr_node = &qt->nodes[curr_idx];
+    float size2 = curr_node->size * curr_node->size;
+
+    float dx = curr_node->c_x - x;
+    float dy = curr_node->c_y - y;
+    float dist2 = dx * dx + dy * dy;
+    if (dist2 < eps2)
+      dist2 = eps2;
+
+    if (qt_is_leaf(curr_node) || size2 < dist2 * theta2) {
+
+      float inv_dist = qt_inv_dist(dist2, qt->precision);
+      float inv_dist3 = inv_dist * inv_dist * inv_dist;
+      float a = G * curr_node->mass * inv_dist3;
+
+      *ax += a * dx;
+      *ay += a * dy;
+
+      // The body's own leaf sits at zero distance, leaving out its own
+      // mass keeps any bodies merged into it (qt_insert case 3)
+      float m = curr_node->mass;
+      if (dx == 0 && dy == 0)
+        m -= mass;
+      phi -= G * m * inv_dist;
+
+      if (curr_node->next == 0) {
+        break;
+      }
+      curr_idx = curr_node->next;
+    } else {
+      curr_idx = curr_node->first_child;
+    }
+  }
 
-    parent->c_x = (m1 * x1 + m2 * x2 + m3 * x3 + m4 * x4) / total_mass;
-    parent->c_y = (m1 * y1 + m2 * y2 + m3 * y3 + m4 * y4) / total_mass;
-    parent->mass = total_mass;
+  if (pot) {
+    *pot = phi;
   }
 
   return QT_SUCCESS;
 }
 
-QuadTreeError qt_acc(QuadTree *qt, float x, float y, float theta, float eps,
-                     float G, float *ax, float *ay) {
+QuadTreeError qt_acc_rel(QuadTree *qt, float x, float y, float mass,
+                         float a_old, float alpha, float eps, float G,
+                         float *ax, float *ay, float *pot) {
   if (!qt) {
     return QT_INVALID_POINTER;
   }
 
   *ax = 0;
   *ay = 0;
+  float phi = 0; // potential, only stored when pot is given
 
-  float theta2 = theta * theta;
+  // Node is accepted when its estimated force error G * M * l^2 / r^4 is
+  // below alpha * |a_old| (relative criterion, as in GADGET)
+  float tol = alpha * a_old / G;
   float eps2 = eps * eps;
 
   int curr_idx = 0;
@@ -212,15 +298,32 @@ QuadTreeError qt_acc(QuadTree *qt, float x, float y, float theta, float eps,
     if (dist2 < eps2)
       dist2 = eps2;
 
-    if (qt_is_leaf(curr_node) || size2 < dist2 * theta2) {
+    int accept = qt_is_leaf(curr_node);
+    if (!accept) {
+      // Never accept a node containing the body (10% margin)
+      float half = 0.6f * curr_node->size;
+      int inside = fabsf(x - curr_node->s_x) < half &&
+                   fabsf(y - curr_node->s_y) < half;
+
+      accept = !inside && curr_node->mass * size2 <= tol * dist2 * dist2;
+    }
 
-      float inv_dist = 1.0f / sqrtf(dist2);
+    if (accept) {
+
+      float inv_dist = qt_inv_dist(dist2, qt->precision);
       float inv_dist3 = inv_dist * inv_dist * inv_dist;
       float a = G * curr_node->mass * inv_dist3;
 
       *ax += a * dx;
       *ay += a * dy;
 
+      // The body's own leaf sits at zero distance, leaving out its own
+      // mass keeps any bodies merged into it (qt_insert case 3)
+      float m = curr_node->mass;
+      if (dx == 0 && dy == 0)
+        m -= mass;
+      phi -= G * m * inv_dist;
+
       if (curr_node->next == 0) {
         break;
       }
@@ -230,9 +333,158 @@ QuadTreeError qt_acc(QuadTree *qt, float x, float y, float theta, float eps,
     }
   }
 
+  if (pot) {
+    *pot = phi;
+  }
+
+  return QT_SUCCESS;
+}
+
+// Dual tree walk: interacts pairs of nodes instead of single bodies against
+// the tree. Well separated pairs add one field expansion to the target node,
+// which is then pushed down to the leaves. Call qt_dual_acc afterwards to
+// read the acceleration of each body. Target subtrees are split over OpenMP
+// tasks; when called from inside a parallel region it must be from a single
+// thread (e.g. omp single) so the other threads pick up the tasks.
+QuadTreeError qt_dual_walk(QuadTree *qt, float theta, float eps, float G) {
+  if (!qt) {
+    return QT_INVALID_POINTER;
+  }
+
+  // Check to see if we will be over capacity
+  if (qt->node_count > qt->local_capacity) {
+    while (qt->node_count > qt->local_capacity) {
+      qt->local_capacity = qt->local_capacity ? 2 * qt->local_capacity
+                                              : qt->node_capacity;
+    }
+
+    free(qt->locals);
+    qt->locals = malloc(qt->local_capacity * sizeof(QuadTreeLocal));
+    if (!qt->locals) {
+      qt->local_capacity = 0;
+      return QT_ALLOC_FAILURE;
+    }
+  }
+
+  memset(qt->locals, 0, qt->node_count * sizeof(QuadTreeLocal));
+
+  float theta2 = theta * theta;
+  float eps2 = eps * eps;
+
+  // Bodies merged into one leaf sit at zero (softened to eps) distance
+  qt->leaf_pot = -G * qt_inv_dist(eps2, qt->precision);
+
+  if (omp_in_parallel()) {
+    qt_dual_interact(qt, 0, 0, theta2, eps2, G, 0);
+  } else {
+    #pragma omp parallel
+    #pragma omp single
+    qt_dual_interact(qt, 0, 0, theta2, eps2, G, 0);
+  }
+
+  // Pushing expansions down, parents are ordered top to bottom
+  for (int i = 0; i < qt->parent_count; i++) {
+    QuadTreeNode *parent = &qt->nodes[qt->parents[i]];
+    QuadTreeLocal *pl = &qt->locals[qt->parents[i]];
+
+    for (int j = 0; j < 4; j++) {
+      int child_idx = parent->first_child + j;
+      QuadTreeNode *child = &qt->nodes[child_idx];
+      QuadTreeLocal *cl = &qt->locals[child_idx];
+
+      if (qt_is_empty(child))
+        continue;
+
+      float dx = child->c_x - parent->c_x;
+      float dy = child->c_y - parent->c_y;
+
+      cl->pot += pl->pot - (pl->ax * dx + pl->ay * dy);
+      cl->ax += pl->ax + pl->xx * dx + pl->xy * dy;
+      cl->ay += pl->ay + pl->xy * dx + pl->yy * dy;
+      cl->xx += pl->xx;
+      cl->xy += pl->xy;
+      cl->yy += pl->yy;
+    }
+  }
+
+  return QT_SUCCESS;
+}
+
+QuadTreeError qt_dual_acc(QuadTree *qt, float x, float y, float mass,
+                          float *ax, float *ay, float *pot) {
+  if (!qt || !qt->locals) {
+    return QT_INVALID_POINTER;
+  }
+
+  // Finding the leaf the body was inserted into
+  int curr_idx = 0;
+  while (!qt_is_leaf(&qt->nodes[curr_idx])) {
+    QuadTreeNode *curr_node = &qt->nodes[curr_idx];
+    curr_idx = curr_node->first_child + qt_get_child(curr_node, x, y);
+  }
+
+  QuadTreeNode *leaf = &qt->nodes[curr_idx];
+  QuadTreeLocal *l = &qt->locals[curr_idx];
+
+  float dx = x - leaf->c_x;
+  float dy = y - leaf->c_y;
+
+  *ax = l->ax + l->xx * dx + l->xy * dy;
+  *ay = l->ay + l->xy * dx + l->yy * dy;
+
+  // grad(pot) = -a, plus the other bodies merged into this leaf
+  if (pot) {
+    *pot = l->pot - (l->ax * dx + l->ay * dy) +
+           qt->leaf_pot * (leaf->mass - mass);
+  }
+
   return QT_SUCCESS;
 }
 
+// Copies the node array once per OpenMP place (e.g. OMP_PLACES=sockets).
+// Each copy is written by a thread running on its place, so first touch puts
+// it in that place's local memory. Only worth it with bound threads and more
+// than one place; otherwise no copies are made and qt_local_nodes returns the
+// shared array. Call it outside a parallel region or from every thread of
+// the current team.
+QuadTreeError qt_replicate(QuadTree *qt) {
+  if (!qt) {
+    return QT_INVALID_POINTER;
+  }
+
+  int place_count = omp_get_num_places();
+  if (place_count <= 1) {
+    return QT_SUCCESS;
+  }
+
+  if (omp_in_parallel()) {
+    return qt_replicate_team(qt, place_count);
+  }
+
+  QuadTreeError err = QT_SUCCESS;
+
+  #pragma omp parallel
+  {
+    QuadTreeError thread_err = qt_replicate_team(qt, place_count);
+
+    #pragma omp single nowait
+    err = thread_err;
+  }
+
+  return err;
+}
+
+// Node array for the calling thread: its place's replica when qt_replicate
+// made them, the shared array otherwise
+QuadTreeNode *qt_local_nodes(QuadTree *qt) {
+  int place = omp_get_place_num();
+  if (qt->replica_count == 0 || place < 0 || place >= qt->replica_count) {
+    return qt->nodes;
+  }
+
+  return qt->replicas[place];
+}
+
 // Helper functions
 int qt_is_empty(QuadTreeNode *node) { return node->mass == 0; }
 
@@ -252,13 +504,15 @@ QuadTreeError qt_add_node(QuadTree *qt, QuadTreeNode node) {
   }
 
   // Check to see if we will be over capacity
-  while (qt->node_count + 1 > qt->node_capacity) {
-    qt->node_capacity *= 2;
-  }
+  if (qt->node_count + 1 > qt->node_capacity) {
+    while (qt->node_count + 1 > qt->node_capacity) {
+      qt->node_capacity *= 2;
+    }
 
-  qt->nodes = realloc(qt->nodes, qt->node_capacity * sizeof(QuadTreeNode));
-  if (!qt->nodes) {
-    return QT_ALLOC_FAILURE;
+    qt->nodes = realloc(qt->nodes, qt->node_capacity * sizeof(QuadTreeNode));
+    if (!qt->nodes) {
+      return QT_ALLOC_FAILURE;
+    }
   }
 
   // Add node
@@ -274,13 +528,15 @@ QuadTreeError qt_add_parent(QuadTree *qt, int parent_idx) {
   }
 
   // Check to see if we will be over capacity
-  while (qt->parent_count + 1 > qt->parent_capacity) {
-    qt->parent_capacity *= 2;
-  }
+  if (qt->parent_count + 1 > qt->parent_capacity) {
+    while (qt->parent_count + 1 > qt->parent_capacity) {
+      qt->parent_capacity *= 2;
+    }
 
-  qt->parents = realloc(qt->parents, qt->parent_capacity * sizeof(int));
-  if (!qt->parents) {
-    return QT_ALLOC_FAILURE;
+    qt->parents = realloc(qt->parents, qt->parent_capacity * sizeof(int));
+    if (!qt->parents) {
+      return QT_ALLOC_FAILURE;
+    }
   }
 
   qt->parents[qt->parent_count] = parent_idx;
@@ -336,3 +592,240 @@ QuadTreeError qt_subdivide(QuadTree *qt, QuadTreeNode *node) {
 
   return QT_SUCCESS;
 }
+
+// Frees every replica so qt_local_nodes returns the shared array
+void qt_drop_replicas(QuadTree *qt) {
+  for (int i = 0; i < qt->replica_count; i++) {
+    free(qt->replicas[i]);
+  }
+  free(qt->replicas);
+
+  qt->replicas = NULL;
+  qt->replica_count = 0;
+}
+
+// Sets a parent's centre of mass and mass from its four children
+void qt_propagate_parent(QuadTree *qt, int parent_idx) {
+  QuadTreeNode *parent = &qt->nodes[parent_idx];
+
+  float x1 = qt->nodes[parent->first_child].c_x;
+  float y1 = qt->nodes[parent->first_child].c_y;
+  float m1 = qt->nodes[parent->first_child].mass;
+
+  float x2 = qt->nodes[parent->first_child + 1].c_x;
+  float y2 = qt->nodes[parent->first_child + 1].c_y;
+  float m2 = qt->nodes[parent->first_child + 1].mass;
+
+  float x3 = qt->nodes[parent->first_child + 2].c_x;
+  float y3 = qt->nodes[parent->first_child + 2].c_y;
+  float m3 = qt->nodes[parent->first_child + 2].mass;
+
+  float x4 = qt->nodes[parent->first_child + 3].c_x;
+  float y4 = qt->nodes[parent->first_child + 3].c_y;
+  float m4 = qt->nodes[parent->first_child + 3].mass;
+
+  float total_mass = m1 + m2 + m3 + m4;
+
+  parent->c_x = (m1 * x1 + m2 * x2 + m3 * x3 + m4 * x4) / total_mass;
+  parent->c_y = (m1 * y1 + m2 * y2 + m3 * y3 + m4 * y4) / total_mass;
+  parent->mass = total_mass;
+}
+
+// Children before their parent, the upper levels as one task per subtree
+void qt_propagate_subtree(QuadTree *qt, int idx, int depth) {
+  int first_child = qt->nodes[idx].first_child;
+  if (first_child == 0) {
+    return;
+  }
+
+  for (int i = 0; i < 4; i++) {
+    int child_idx = first_child + i;
+    if (qt->nodes[child_idx].first_child == 0)
+      continue;
+
+    if (depth < QT_PROPAGATE_TASK_DEPTH) {
+      #pragma omp task
+      qt_propagate_subtree(qt, child_idx, depth + 1);
+    } else {
+      qt_propagate_subtree(qt, child_idx, depth + 1);
+    }
+  }
+
+  if (depth < QT_PROPAGATE_TASK_DEPTH) {
+    #pragma omp taskwait
+  }
+
+  qt_propagate_parent(qt, idx);
+}
+
+// Body of qt_replicate, run by every thread of the team
+QuadTreeError qt_replicate_team(QuadTree *qt, int place_count) {
+  #pragma omp single
+  {
+    if (qt->replica_count != place_count ||
+        qt->node_count > qt->replica_capacity) {
+      qt_drop_replicas(qt);
+      free(qt->replica_claimed);
+
+      qt->replica_capacity = qt->node_capacity;
+      qt->replicas = malloc(place_count * sizeof(QuadTreeNode *));
+      qt->replica_claimed = malloc(place_count * sizeof(int));
+
+      if (qt->replicas && qt->replica_claimed) {
+        for (int i = 0; i < place_count; i++) {
+          qt->replicas[i] =
+              malloc(qt->replica_capacity * sizeof(QuadTreeNode));
+          if (!qt->replicas[i])
+            break;
+          qt->replica_count++;
+        }
+      }
+
+      // All or nothing, qt_local_nodes falls back to the shared array
+      if (qt->replica_count != place_count) {
+        qt_drop_replicas(qt);
+      }
+    }
+
+    if (qt->replica_count == place_count) {
+      memset(qt->replica_claimed, 0, place_count * sizeof(int));
+    }
+  }
+
+  if (qt->replica_count != place_count) {
+    return QT_ALLOC_FAILURE;
+  }
+
+  // The first thread to reach each place copies into its replica
+  int place = omp_get_place_num();
+  if (place >= 0) {
+    int first;
+    #pragma omp atomic capture
+    first = qt->replica_claimed[place]++;
+
+    if (first == 0) {
+      memcpy(qt->replicas[place], qt->nodes,
+             qt->node_count * sizeof(QuadTreeNode));
+    }
+  }
+
+  #pragma omp barrier
+
+  // Places no thread ran on still need a valid copy
+  #pragma omp single
+  for (int i = 0; i < place_count; i++) {
+    if (!qt->replica_claimed[i]) {
+      memcpy(qt->replicas[i], qt->nodes,
+             qt->node_count * sizeof(QuadTreeNode));
+    }
+  }
+
+  return QT_SUCCESS;
+}
+
+void qt_dual_interact(QuadTree *qt, int t_idx, int s_idx, float theta2,
+                      float eps2, float G, int depth) {
+  QuadTreeNode *target = &qt->nodes[t_idx];
+  QuadTreeNode *source = &qt->nodes[s_idx];
+
+  if (qt_is_empty(target) || qt_is_empty(source)) {
+    return;
+  }
+
+  // Self interaction: every ordered pair of children, one task per target
+  if (t_idx == s_idx) {
+    if (qt_is_leaf(target)) {
+      return;
+    }
+
+    if (depth < QT_DUAL_TASK_DEPTH) {
+      for (int i = 0; i < 4; i++) {
+        int t_child = target->first_child + i;
+        #pragma omp task
+        for (int j = 0; j < 4; j++) {
+          qt_dual_interact(qt, t_child, target->first_child + j, theta2, eps2,
+                           G, depth + 1);
+        }
+      }
+      #pragma omp taskwait
+    } else {
+      for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+          qt_dual_interact(qt, target->first_child + i,
+                           target->first_child + j, theta2, eps2, G,
+                           depth + 1);
+        }
+      }
+    }
+
+    return;
+  }
+
+  float dx = source->c_x - target->c_x;
+  float dy = source->c_y - target->c_y;
+  float dist2 = dx * dx + dy * dy;
+  if (dist2 < eps2)
+    dist2 = eps2;
+
+  // Bodies of a leaf all sit on its centre of mass so it has no extent
+  int t_leaf = qt_is_leaf(target);
+  int s_leaf = qt_is_leaf(source);
+  float reach = (t_leaf ? 0 : target->size) + source->size;
+
+  if ((t_leaf && s_leaf) || reach * reach < dist2 * theta2) {
+    QuadTreeLocal *l = &qt->locals[t_idx];
+
+    float inv_dist = qt_inv_dist(dist2, qt->precision);
+    float inv_dist3 = inv_dist * inv_dist * inv_dist;
+    float a = G * source->mass * inv_dist3;
+
+    l->pot -= G * source->mass * inv_dist;
+    l->ax += a * dx;
+    l->ay += a * dy;
+
+    if (!t_leaf) {
+      float b = 3.0f * a * inv_dist * inv_dist;
+      l->xx += b * dx * dx - a;
+      l->xy += b * dx * dy;
+      l->yy += b * dy * dy - a;
+    }
+
+    return;
+  }
+
+  if (t_leaf || (!s_leaf && source->size > target->size)) {
+    // Splitting the source, the target stays with this task
+    for (int j = 0; j < 4; j++) {
+      qt_dual_interact(qt, t_idx, source->first_child + j, theta2, eps2, G,
+                       depth);
+    }
+  } else {
+    // Splitting the target, children are disjoint so each gets a task
+    if (depth < QT_DUAL_TASK_DEPTH) {
+      for (int i = 0; i < 4; i++) {
+        int t_child = target->first_child + i;
+        #pragma omp task
+        qt_dual_interact(qt, t_child, s_idx, theta2, eps2, G, depth + 1);
+      }
+      #pragma omp taskwait
+    } else {
+      for (int i = 0; i < 4; i++) {
+        qt_dual_interact(qt, target->first_child + i, s_idx, theta2, eps2, G,
+                         depth + 1);
+      }
+    }
+  }
+}
+
+static inline float qt_inv_dist(float dist2, QuadTreePrecision precision) {
+  if (precision == QT_PRECISION_EXACT) {
+    return 1.0f / sqrtf(dist2);
+  }
+
+  float inv_dist = fast_inv_sqrt(dist2);
+  if (precision == QT_PRECISION_RSQRT2) {
+    inv_dist *= 1.5f - 0.5f * dist2 * inv_dist * inv_dist;
+  }
+
+  return inv_dist;
+}
@@ -7,6 +7,12 @@ typedef enum QuadTreeError {
   QT_INVALID_POINTER,
 } QuadTreeError;
 
+typedef enum QuadTreePrecision {
+  QT_PRECISION_EXACT,  // 1 / sqrtf
+  QT_PRECISION_RSQRT1, // hardware rsqrt + one Newton-Raphson step
+  QT_PRECISION_RSQRT2, // hardware rsqrt + two Newton-Raphson steps
+} QuadTreePrecision;
+
 typedef struct QuadTreeNode {
   float c_x, c_y; // Centre of mass coords
   float mass;     // Total mass in node
@@ -18,6 +24,12 @@ typedef struct QuadTreeNode {
   int next;        // index of next node (see qt_acc)
 } QuadTreeNode;
 
+typedef struct QuadTreeLocal {
+  float pot;         // Far-field potential at the node centre of mass
+  float ax, ay;      // Far-field acceleration at the node centre of mass
+  float xx, xy, yy;  // Gradient of that acceleration (first order Taylor)
+} QuadTreeLocal;
+
 typedef struct QuadTree {
   QuadTreeNode *nodes;
   int node_count;
@@ -26,6 +38,20 @@ typedef struct QuadTree {
   int *parents; // index of non-leaf nodes (top to bottom ordered)
   int parent_count;
   int parent_capacity;
+
+  QuadTreeLocal *locals; // per node field expansions (see qt_dual_walk)
+  int local_capacity;
+  float leaf_pot;        // pair potential per unit mass inside one leaf
+
+  // Force kernel used by qt_acc, qt_acc_rel and qt_dual_interact. The walks
+  // are bound by node loads, not the square root, so the rsqrt modes give no
+  // speedup yet (measured equal or slower than exact)
+  QuadTreePrecision precision;
+
+  QuadTreeNode **replicas; // per OpenMP place copies of nodes (see qt_replicate)
+  int *replica_claimed;    // threads that reached each place in qt_replicate
+  int replica_count;
+  int replica_capacity;
 } QuadTree;
 
 QuadTree *qt_create(int node_capacity);
@@ -34,8 +60,17 @@ QuadTreeError qt_set(QuadTree *qt, float max_x, float max_y, float min_x,
                      float min_y);
 QuadTreeError qt_insert(QuadTree *qt, float x, float y, float mass);
 QuadTreeError qt_propagate(QuadTree *qt);
-QuadTreeError qt_acc(QuadTree *qt, float x, float y, float theta, float eps,
-                     float G, float *ax, float *ay);
+QuadTreeError qt_acc(QuadTree *qt, float x, float y, float mass, float theta,
+                     float eps, float G, float *ax, float *ay, float *pot);
+QuadTreeError qt_acc_rel(QuadTree *qt, float x, float y, float mass,
+                         float a_old, float alpha, float eps, float G,
+                         float *ax, float *ay, float *pot);
+QuadTreeError qt_dual_walk(QuadTree *qt, float theta, float eps, float G);
+QuadTreeError qt_dual_acc(QuadTree *qt, float x, float y, float mass,
+                          float *ax, float *ay, float *pot);
+
+QuadTreeError qt_replicate(QuadTree *qt);
+QuadTreeNode *qt_local_nodes(QuadTree *qt);
 
 int qt_is_empty(QuadTreeNode *node);
 int qt_is_leaf(QuadTreeNode *node);
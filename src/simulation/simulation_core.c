@@ -1,17 +1,34 @@
 #include "quadtree.h"
 #include "body_data.h"
 #include "simulation_core.h"
+#include "simulation_export.h"
 #include "simulation_interface.h"
+#include "simulation_snapshot.h"
 #include <math.h>
 #include <stdlib.h>
 #include <omp.h>
+#include <stdio.h>
 
 SimulationCore *sim_core_create(const SimulationParams params,
                                 int qt_node_capacity) {
+  return sim_core_create_from_bodies(
+      params, body_data_create(params.body_count), qt_node_capacity);
+}
+
+SimulationCore *sim_core_create_from_bodies(const SimulationParams params,
+                                            BodyData *bodies,
+                                            int qt_node_capacity) {
   SimulationCore *core = malloc(sizeof(SimulationCore));
-  core->bodies = body_data_create(params.body_count);
+  core->bodies = bodies;
   core->params = params;
   core->qt = qt_create(qt_node_capacity);
+  core->step_count = 0;
+  core->time = 0;
+  core->diag = (SimulationDiagnostics){0};
+  core->diag_fd = -1;
+  core->stats = (SimulationStats){0};
+  core->exporter = NULL;
+  core->snapshots = NULL;
   return core;
 }
 
@@ -23,81 +40,274 @@ void sim_core_destroy(SimulationCore *core) {
   }
 }
 
-void sim_core_init_leapfrog(SimulationCore *core) {
-  float max_x = -INFINITY, min_x = INFINITY;
-  float max_y = -INFINITY, min_y = INFINITY;
-
+// Fills ax/ay (and pot when with_pot is set) for every body from the built
+// tree and kicks its velocity by kick * a. With dual_tree set the tree is
+// walked once cell against cell, otherwise each body walks it: bodies with a
+// previous |a| use the relative opening criterion when err_tol is set, the
+// rest fall back to the geometric theta criterion. Called by every thread of
+// the step's parallel region.
+static void sim_core_compute_acc(SimulationCore *core, int with_pot,
+                                 float kick) {
   BodyData *bodies = core->bodies;
+  SimulationParams params = core->params;
+
+  // Falling back to walking the tree per body for this step when the field
+  // expansions can't be allocated
+  int dual_tree = 0;
+
+  #pragma omp single copyprivate(dual_tree)
+  {
+    core->qt->precision = params.precision;
 
+    dual_tree = params.dual_tree &&
+                qt_dual_walk(core->qt, params.theta, params.eps, params.G) ==
+                    QT_SUCCESS;
+  }
+
+  // Falling back to the shared tree when the copies can't be made
+  int replicated =
+      params.replicate_tree && qt_replicate(core->qt) == QT_SUCCESS;
+
+  // Thread local view of the tree, reading this place's node replica
+  QuadTree qt = *core->qt;
+  if (replicated) {
+    qt.nodes = qt_local_nodes(core->qt);
+  }
+
+  #pragma omp for schedule(static)
   for (int i = 0; i < bodies->count; i++) {
-    if (bodies->x[i] > max_x)
-      max_x = bodies->x[i];
-    if (bodies->x[i] < min_x)
-      min_x = bodies->x[i];
-    if (bodies->y[i] > max_y)
-      max_y = bodies->y[i];
-    if (bodies->y[i] < min_y)
-      min_y = bodies->y[i];
+    float *pot = with_pot ? &bodies->pot[i] : NULL;
+
+    if (dual_tree) {
+      qt_dual_acc(&qt, bodies->x[i], bodies->y[i], bodies->mass[i],
+                  &bodies->ax[i], &bodies->ay[i], pot);
+    } else if (params.err_tol > 0 && bodies->a_mag[i] > 0) {
+      qt_acc_rel(&qt, bodies->x[i], bodies->y[i], bodies->mass[i],
+                 bodies->a_mag[i], params.err_tol, params.eps, params.G,
+                 &bodies->ax[i], &bodies->ay[i], pot);
+    } else {
+      qt_acc(&qt, bodies->x[i], bodies->y[i], bodies->mass[i],
+             params.theta, params.eps, params.G, &bodies->ax[i],
+             &bodies->ay[i], pot);
+    }
+
+    bodies->a_mag[i] = sqrtf(bodies->ax[i] * bodies->ax[i] +
+                             bodies->ay[i] * bodies->ay[i]);
+
+    // Kicking while the body's data is still in cache
+    bodies->vx[i] += bodies->ax[i] * kick;
+    bodies->vy[i] += bodies->ay[i] * kick;
   }
+}
+
+// Rebuilds the tree over the given bounds. Insertion is serial, call it from
+// one thread.
+static void sim_core_build_tree(SimulationCore *core, float max_x,
+                                float max_y, float min_x, float min_y) {
+  BodyData *bodies = core->bodies;
 
   qt_set(core->qt, max_x, max_y, min_x, min_y);
 
   for (int i = 0; i < bodies->count; i++) {
     qt_insert(core->qt, bodies->x[i], bodies->y[i], bodies->mass[i]);
   }
+}
 
-  qt_propagate(core->qt);
+// Reduces energies and momenta into core->diag and streams them to diag_fd.
+// Velocities are half a step off the positions, kick * a brings them level.
+static void sim_core_take_diagnostics(SimulationCore *core, float kick) {
+  BodyData *bodies = core->bodies;
+  double kinetic = 0, potential = 0;
+  double px = 0, py = 0, lz = 0;
 
-  #pragma omp parallel for
+  #pragma omp parallel for schedule(static) \
+      reduction(+ : kinetic, potential, px, py, lz)
   for (int i = 0; i < bodies->count; i++) {
-    qt_acc(core->qt, bodies->x[i], bodies->y[i], core->params.theta,
-           core->params.eps, core->params.G, &bodies->ax[i], &bodies->ay[i]);
+    float m = bodies->mass[i];
+    float vx = bodies->vx[i] + kick * bodies->ax[i];
+    float vy = bodies->vy[i] + kick * bodies->ay[i];
+
+    kinetic += 0.5 * m * (vx * vx + vy * vy);
+    potential += 0.5 * m * bodies->pot[i]; // each pair counted twice
+    px += m * vx;
+    py += m * vy;
+    lz += m * (bodies->x[i] * vy - bodies->y[i] * vx);
   }
 
-  for (int i = 0; i < bodies->count; i++) {
-    bodies->vx[i] -= bodies->ax[i] * 0.5 * core->params.dt;
-    bodies->vy[i] -= bodies->ay[i] * 0.5 * core->params.dt;
+  core->diag.step = core->step_count;
+  core->diag.time = core->time;
+  core->diag.kinetic = kinetic;
+  core->diag.potential = potential;
+  core->diag.total = kinetic + potential;
+  core->diag.px = px;
+  core->diag.py = py;
+  core->diag.lz = lz;
+
+  if (core->diag_fd >= 0) {
+    sim_record_diagnostics(&core->diag, core->diag_fd);
   }
 }
 
-void sim_core_step(SimulationCore *core) {
+void sim_core_init_leapfrog(SimulationCore *core) {
   float max_x = -INFINITY, min_x = INFINITY;
   float max_y = -INFINITY, min_y = INFINITY;
 
   BodyData *bodies = core->bodies;
+  int with_diag = core->params.diag_interval > 0;
 
-  for (int i = 0; i < bodies->count; i++) {
-    if (bodies->x[i] > max_x)
-      max_x = bodies->x[i];
-    if (bodies->x[i] < min_x)
-      min_x = bodies->x[i];
-    if (bodies->y[i] > max_y)
-      max_y = bodies->y[i];
-    if (bodies->y[i] < min_y)
-      min_y = bodies->y[i];
+  #pragma omp parallel
+  {
+    // No previous |a| after (re)initialisation, seed it with the theta walk
+    #pragma omp for schedule(static) \
+        reduction(max : max_x, max_y) reduction(min : min_x, min_y)
+    for (int i = 0; i < bodies->count; i++) {
+      bodies->a_mag[i] = 0;
+
+      if (bodies->x[i] > max_x)
+        max_x = bodies->x[i];
+      if (bodies->x[i] < min_x)
+        min_x = bodies->x[i];
+      if (bodies->y[i] > max_y)
+        max_y = bodies->y[i];
+      if (bodies->y[i] < min_y)
+        min_y = bodies->y[i];
+    }
+
+    #pragma omp single
+    {
+      sim_core_build_tree(core, max_x, max_y, min_x, min_y);
+      qt_propagate(core->qt);
+    }
+
+    // Steps drift before they kick, so velocities are kept at t + dt/2
+    sim_core_compute_acc(core, with_diag, 0.5f * core->params.dt);
   }
 
-  for (int i = 0; i < bodies->count; i++) {
-    bodies->x[i] += bodies->vx[i] * core->params.dt;
-    bodies->y[i] += bodies->vy[i] * core->params.dt;
+  core->step_count = 0;
+  core->time = 0;
+  if (with_diag) {
+    sim_core_take_diagnostics(core, -0.5f * core->params.dt);
   }
+}
 
-  qt_set(core->qt, max_x, max_y, min_x, min_y);
+// The whole step runs in one parallel region: drift (bounding the drifted
+// positions on the way), serial tree build, propagation as tasks, then the
+// force walk with the kick fused in. Diagnostics and output streams follow
+// outside it when due.
+void sim_core_step(SimulationCore *core) {
+  float max_x = -INFINITY, min_x = INFINITY;
+  float max_y = -INFINITY, min_y = INFINITY;
 
-  for (int i = 0; i < bodies->count; i++) {
-    qt_insert(core->qt, bodies->x[i], bodies->y[i], bodies->mass[i]);
+  BodyData *bodies = core->bodies;
+  SimulationStats *stats = &core->stats;
+  float dt = core->params.dt;
+
+  int interval = core->params.diag_interval;
+  int with_diag = interval > 0 && (core->step_count + 1) % interval == 0;
+
+  double t0 = omp_get_wtime();
+  double t1, t2, t3;
+
+  #pragma omp parallel
+  {
+    #pragma omp for schedule(static) \
+        reduction(max : max_x, max_y) reduction(min : min_x, min_y)
+    for (int i = 0; i < bodies->count; i++) {
+      float x = bodies->x[i] + bodies->vx[i] * dt;
+      float y = bodies->y[i] + bodies->vy[i] * dt;
+      bodies->x[i] = x;
+      bodies->y[i] = y;
+
+      if (x > max_x)
+        max_x = x;
+      if (x < min_x)
+        min_x = x;
+      if (y > max_y)
+        max_y = y;
+      if (y < min_y)
+        min_y = y;
+    }
+
+    #pragma omp single
+    {
+      t1 = omp_get_wtime();
+      sim_core_build_tree(core, max_x, max_y, min_x, min_y);
+
+      t2 = omp_get_wtime();
+      qt_propagate(core->qt);
+
+      t3 = omp_get_wtime();
+    }
+
+    sim_core_compute_acc(core, with_diag, dt);
   }
 
-  qt_propagate(core->qt);
+  stats->drift = t1 - t0;
+  stats->build = t2 - t1;
+  stats->propagate = t3 - t2;
+  stats->force = omp_get_wtime() - t3;
 
-  #pragma omp parallel for
-  for (int i = 0; i < bodies->count; i++) {
-    qt_acc(core->qt, bodies->x[i], bodies->y[i], core->params.theta,
-           core->params.eps, core->params.G, &bodies->ax[i], &bodies->ay[i]);
+  core->step_count++;
+  core->time += dt;
+  if (with_diag) {
+    sim_core_take_diagnostics(core, -0.5f * dt);
   }
 
-  for (int i = 0; i < bodies->count; i++) {
-    bodies->vx[i] += bodies->ax[i] * core->params.dt;
-    bodies->vy[i] += bodies->ay[i] * core->params.dt;
+  interval = core->params.export_interval;
+  if (core->exporter && interval > 0 && core->step_count % interval == 0) {
+    sim_export_publish(core->exporter, core);
+  }
+
+  interval = core->params.snapshot_interval;
+  if (core->snapshots && interval > 0 && core->step_count % interval == 0) {
+    SnapshotError err = snap_writer_push(core->snapshots, core);
+    if (err != SNAP_SUCCESS) {
+      fprintf(stderr, "Snapshot stream failed at step %d (error %d), "
+              "no further snapshots\n", core->step_count, err);
+      core->snapshots = NULL;
+    }
   }
 }
+
+SimulationDiagnostics sim_core_diagnostics(const SimulationCore *core) {
+  return core->diag;
+}
+
+float sim_core_force_error(const SimulationCore *core, int sample_count) {
+  const BodyData *bodies = core->bodies;
+  if (sample_count <= 0 || sample_count > bodies->count)
+    sample_count = bodies->count;
+
+  int stride = bodies->count / sample_count;
+  float eps2 = core->params.eps * core->params.eps;
+  double err_sum = 0;
+
+  #pragma omp parallel for reduction(+ : err_sum)
+  for (int s = 0; s < sample_count; s++) {
+    int i = s * stride;
+    double ax = 0, ay = 0;
+
+    // Direct summation with the same softening as the tree walk
+    for (int j = 0; j < bodies->count; j++) {
+      float dx = bodies->x[j] - bodies->x[i];
+      float dy = bodies->y[j] - bodies->y[i];
+      float dist2 = dx * dx + dy * dy;
+      if (dist2 < eps2)
+        dist2 = eps2;
+
+      double inv_dist = 1.0 / sqrt(dist2);
+      double a = core->params.G * bodies->mass[j] * inv_dist * inv_dist *
+                 inv_dist;
+      ax += a * dx;
+      ay += a * dy;
+    }
+
+    double ex = bodies->ax[i] - ax;
+    double ey = bodies->ay[i] - ay;
+    double a2 = ax * ax + ay * ay;
+    if (a2 > 0)
+      err_sum += sqrt((ex * ex + ey * ey) / a2);
+  }
+
+  return err_sum / sample_count;
+}
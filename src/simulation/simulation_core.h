@@ -5,18 +5,51 @@
 #include "quadtree.h"
 #include "simulation_interface.h"
 
+struct SimExport;
+struct SnapshotWriter;
+
+typedef struct SimulationStats {
+  double drift;     // seconds spent drifting and bounding positions
+  double build;     // seconds spent inserting into the tree
+  double propagate; // seconds spent in qt_propagate
+  double force;     // seconds spent computing accelerations and kicking
+} SimulationStats;
+
 typedef struct SimulationCore {
   BodyData *bodies;
   SimulationParams params;
 
   QuadTree *qt;
+
+  int step_count; // steps since sim_core_init_leapfrog
+  float time;     // simulation time since sim_core_init_leapfrog
+
+  SimulationDiagnostics diag; // last diagnostics (every diag_interval steps)
+  int diag_fd;                // CSV stream for diag, -1 for none
+
+  SimulationStats stats; // phase timings of the last step
+
+  // Output streams, not owned, NULL when disabled
+  struct SimExport *exporter;       // shared memory frame ring
+  struct SnapshotWriter *snapshots; // compressed trajectory file
 } SimulationCore;
 
 SimulationCore *sim_core_create(SimulationParams params, int qt_node_capacity);
+// Takes ownership of bodies (e.g. from sim_load_bodies)
+SimulationCore *sim_core_create_from_bodies(SimulationParams params,
+                                            BodyData *bodies,
+                                            int qt_node_capacity);
 void sim_core_destroy(SimulationCore *core);
 
 // Physics-only functions
 void sim_core_init_leapfrog(SimulationCore *core);
 void sim_core_step(SimulationCore *core);
 
+// Last conservation diagnostics, taken every params.diag_interval steps
+SimulationDiagnostics sim_core_diagnostics(const SimulationCore *core);
+
+// Mean relative error of the current ax/ay against direct summation, over
+// sample_count evenly strided bodies (<= 0 samples every body)
+float sim_core_force_error(const SimulationCore *core, int sample_count);
+
 #endif
@@ -0,0 +1,223 @@
+#include "simulation_export.h"
+#include "simulation_core.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Frames are padded to cache lines so neighbouring seq counters don't share
+#define SIM_EXPORT_ALIGN 64
+
+// Reads give up after this many torn copies in a row
+#define SIM_EXPORT_READ_RETRIES 8
+
+// Helper function prototypes
+SimExportFrame *sim_export_frame(SimExport *exp, uint64_t generation);
+
+SimExport *sim_export_map(const char *name, int fd, size_t size, int prot,
+                          int owner);
+
+SimExport *sim_export_create(const char *name, int body_capacity,
+                             int frame_count) {
+  size_t frame_size =
+      sizeof(SimExportFrame) + 2 * body_capacity * sizeof(float);
+  frame_size = (frame_size + SIM_EXPORT_ALIGN - 1) / SIM_EXPORT_ALIGN *
+               SIM_EXPORT_ALIGN;
+  size_t size = SIM_EXPORT_ALIGN + frame_count * frame_size;
+
+  // A fresh object, processes still mapping an old one keep their copy
+  // instead of faulting on a truncated mapping
+  shm_unlink(name);
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) {
+    perror(name);
+    return NULL;
+  }
+
+  if (ftruncate(fd, size) != 0) {
+    perror(name);
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+
+  SimExport *exp = sim_export_map(name, fd, size, PROT_READ | PROT_WRITE, 1);
+  close(fd);
+  if (!exp) {
+    shm_unlink(name);
+    return NULL;
+  }
+
+  // ftruncate zero fills, so every seq starts even and no frame is valid
+  exp->header->body_capacity = body_capacity;
+  exp->header->frame_count = frame_count;
+  exp->header->frame_size = frame_size;
+  atomic_store_explicit(&exp->header->generation, 0, memory_order_relaxed);
+  atomic_store_explicit(&exp->header->magic, SIM_EXPORT_MAGIC,
+                        memory_order_release);
+
+  return exp;
+}
+
+void sim_export_publish(SimExport *exp, const SimulationCore *core) {
+  SimExportHeader *header = exp->header;
+  uint64_t generation =
+      atomic_load_explicit(&header->generation, memory_order_relaxed) + 1;
+  SimExportFrame *frame = sim_export_frame(exp, generation);
+
+  int count = core->bodies->count;
+  if (count > header->body_capacity)
+    count = header->body_capacity;
+
+  // Seqlock write: odd while copying, readers retry on a changed seq
+  uint64_t seq = atomic_load_explicit(&frame->seq, memory_order_relaxed);
+  atomic_store_explicit(&frame->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  float *x = (float *)(frame + 1);
+  float *y = x + header->body_capacity;
+  memcpy(x, core->bodies->x, count * sizeof(float));
+  memcpy(y, core->bodies->y, count * sizeof(float));
+
+  frame->info.generation = generation;
+  frame->info.step = core->step_count;
+  frame->info.time = core->time;
+  frame->info.count = count;
+  frame->info.s_x = core->qt->nodes[0].s_x;
+  frame->info.s_y = core->qt->nodes[0].s_y;
+  frame->info.size = core->qt->nodes[0].size;
+  frame->info.stats = core->stats;
+
+  atomic_store_explicit(&frame->seq, seq + 2, memory_order_release);
+  atomic_store_explicit(&header->generation, generation,
+                        memory_order_release);
+}
+
+SimExport *sim_export_attach(const char *name) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < SIM_EXPORT_ALIGN) {
+    close(fd);
+    return NULL;
+  }
+
+  SimExport *exp = sim_export_map(name, fd, st.st_size, PROT_READ, 0);
+  close(fd);
+  if (!exp) {
+    return NULL;
+  }
+
+  SimExportHeader *header = exp->header;
+  if (atomic_load_explicit(&header->magic, memory_order_acquire) !=
+          SIM_EXPORT_MAGIC ||
+      header->frame_count <= 0 ||
+      SIM_EXPORT_ALIGN + header->frame_count * header->frame_size >
+          (uint64_t)exp->size) {
+    sim_export_destroy(exp);
+    return NULL;
+  }
+
+  exp->scratch = malloc(2 * (size_t)header->body_capacity * sizeof(float));
+  if (!exp->scratch) {
+    sim_export_destroy(exp);
+    return NULL;
+  }
+
+  return exp;
+}
+
+int sim_export_read(SimExport *exp, uint64_t last_generation, float *x,
+                    float *y, SimExportFrameInfo *info) {
+  SimExportHeader *header = exp->header;
+
+  for (int attempt = 0; attempt < SIM_EXPORT_READ_RETRIES; attempt++) {
+    uint64_t generation =
+        atomic_load_explicit(&header->generation, memory_order_acquire);
+    if (generation == 0 || generation == last_generation) {
+      return 0;
+    }
+
+    SimExportFrame *frame = sim_export_frame(exp, generation);
+
+    uint64_t seq = atomic_load_explicit(&frame->seq, memory_order_acquire);
+    if (seq & 1) {
+      continue;
+    }
+
+    SimExportFrameInfo frame_info = frame->info;
+    int count = frame_info.count;
+    if (count < 0 || count > header->body_capacity) {
+      continue;
+    }
+
+    // Copying into scratch first, the caller's buffers never see a torn frame
+    float *scratch_x = exp->scratch;
+    float *scratch_y = scratch_x + header->body_capacity;
+    const float *src_x = (const float *)(frame + 1);
+    const float *src_y = src_x + header->body_capacity;
+    memcpy(scratch_x, src_x, count * sizeof(float));
+    memcpy(scratch_y, src_y, count * sizeof(float));
+
+    // Copy is only valid if no write started meanwhile
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&frame->seq, memory_order_relaxed) == seq) {
+      memcpy(x, scratch_x, count * sizeof(float));
+      memcpy(y, scratch_y, count * sizeof(float));
+      *info = frame_info;
+      return 1;
+    }
+  }
+
+  return -1;
+}
+
+void sim_export_destroy(SimExport *exp) {
+  if (exp) {
+    munmap(exp->header, exp->size);
+    if (exp->owner) {
+      shm_unlink(exp->name);
+    }
+    free(exp->scratch);
+    free(exp->name);
+    free(exp);
+  }
+}
+
+// Helper functions
+SimExportFrame *sim_export_frame(SimExport *exp, uint64_t generation) {
+  SimExportHeader *header = exp->header;
+  uint64_t slot = (generation - 1) % header->frame_count;
+
+  return (SimExportFrame *)((char *)header + SIM_EXPORT_ALIGN +
+                            slot * header->frame_size);
+}
+
+SimExport *sim_export_map(const char *name, int fd, size_t size, int prot,
+                          int owner) {
+  void *map = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    perror(name);
+    return NULL;
+  }
+
+  SimExport *exp = malloc(sizeof(SimExport));
+  if (!exp) {
+    munmap(map, size);
+    return NULL;
+  }
+
+  exp->name = strdup(name);
+  exp->header = map;
+  exp->size = size;
+  exp->owner = owner;
+  exp->scratch = NULL;
+
+  return exp;
+}
@@ -0,0 +1,70 @@
+#ifndef SIMULATION_EXPORT_H
+#define SIMULATION_EXPORT_H
+
+#include "body_data.h"
+#include "simulation_core.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Live state export through POSIX shared memory. The simulation publishes
+// positions into a ring of frames; viewers in other processes attach by name
+// and read the newest frame. Each frame is guarded by a seqlock so the
+// simulation never waits on a reader.
+
+// Bump the digit whenever SimExportFrameInfo (or SimulationStats inside it)
+// changes, so mismatched viewers refuse to attach
+#define SIM_EXPORT_MAGIC 0x324d534e59444f42ULL // "BODYNSM2"
+
+typedef struct SimExportFrameInfo {
+  uint64_t generation; // publish count when written (1 for the first frame)
+  int step;            // core step_count
+  float time;          // core time
+  int count;           // bodies in the frame
+  float s_x, s_y;      // tree root centre
+  float size;          // tree root side length
+  SimulationStats stats; // phase timings of the step
+} SimExportFrameInfo;
+
+typedef struct SimExportFrame {
+  _Atomic uint64_t seq; // odd while the frame is being written
+  SimExportFrameInfo info;
+  // followed by float x[body_capacity], y[body_capacity]
+} SimExportFrame;
+
+typedef struct SimExportHeader {
+  _Atomic uint64_t magic;         // set last, once the region is ready
+  _Atomic uint64_t generation;    // frames published so far
+  int body_capacity;
+  int frame_count;
+  uint64_t frame_size;            // bytes per frame including positions
+} SimExportHeader;
+
+typedef struct SimExport {
+  char *name;
+  SimExportHeader *header;
+  size_t size;
+  int owner;     // created (and unlinked on destroy) by this process
+  float *scratch; // viewer side copy of a frame until its seq is checked
+} SimExport;
+
+// Simulation side: creates (replacing) the shared memory object name, which
+// must start with '/'. Returns NULL on failure.
+SimExport *sim_export_create(const char *name, int body_capacity,
+                             int frame_count);
+// Copies the current positions into the next frame (clamped to capacity)
+void sim_export_publish(SimExport *exp, const SimulationCore *core);
+
+// Viewer side: maps an existing export read only. Returns NULL on failure.
+SimExport *sim_export_attach(const char *name);
+// Copies the newest frame into x/y (room for body_capacity floats). Returns
+// 1 on a new frame, 0 when nothing newer than last_generation exists and -1
+// when the writer kept overwriting the frame while it was being read. x, y
+// and info are only written when 1 is returned.
+int sim_export_read(SimExport *exp, uint64_t last_generation, float *x,
+                    float *y, SimExportFrameInfo *info);
+
+// Unmaps, and removes the object when exp created it
+void sim_export_destroy(SimExport *exp);
+
+#endif
@@ -2,6 +2,7 @@
 #include "body_data.h"
 #include "helper_funcs.h"
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 void sim_init_uniform(BodyData *data, float min_x, float max_x, float min_y,
@@ -142,3 +143,12 @@ void sim_init_galaxy(BodyData *data, SimulationParams params, int start_idx,
                  velocity_y, temp);
 }
 
+void sim_record_diagnostics_header(int fd) {
+  dprintf(fd, "step,time,kinetic,potential,total,px,py,lz\n");
+}
+
+void sim_record_diagnostics(const SimulationDiagnostics *diag, int fd) {
+  dprintf(fd, "%d,%.6g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g\n", diag->step,
+          diag->time, diag->kinetic, diag->potential, diag->total, diag->px,
+          diag->py, diag->lz);
+}
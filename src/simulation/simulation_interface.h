@@ -4,13 +4,30 @@
 #include "body_data.h"
 
 typedef struct SimulationParams {
-  float G;          // Gravitational constant
-  float eps;        // Softening length
-  float dt;         // Time step
-  float theta;      // BH opening angle
-  int body_count;   // Number of bodies
+  float G;               // Gravitational constant
+  float eps;             // Softening length
+  float dt;              // Time step
+  float theta;           // BH opening angle
+  float err_tol;         // Relative force error tolerance (0 uses theta only)
+  int body_count;        // Number of bodies
+  int dual_tree;         // Use the cell-cell (dual tree) force walk
+  int precision;         // Force kernel precision (QuadTreePrecision)
+  int replicate_tree;    // Copy the tree per OpenMP place for the force walk
+  int diag_interval;     // Steps between conservation diagnostics (0 disables)
+  int export_interval;   // Steps between shared memory frames (0 disables)
+  int snapshot_interval; // Steps between compressed snapshots (0 disables)
 } SimulationParams;
 
+typedef struct SimulationDiagnostics {
+  int step;         // Step the diagnostics were taken at
+  float time;       // Simulation time
+  double kinetic;   // Kinetic energy
+  double potential; // Potential energy
+  double total;     // kinetic + potential
+  double px, py;    // Linear momentum
+  double lz;        // Angular momentum about the origin
+} SimulationDiagnostics;
+
 // Pure initialization functions
 void sim_init_galaxy(BodyData *data, SimulationParams params, int start_idx,
                      int count, float total_mass, float scale_length,
@@ -22,6 +39,7 @@ void sim_init_uniform(BodyData *data, float min_x, float max_x, float min_y,
 
 // File output functions
 void sim_record_positions(BodyData *data, int fd, float time); // TODO
-void sim_record_snapshot(BodyData *data, int fd, float time); // TODO
+void sim_record_diagnostics_header(int fd);
+void sim_record_diagnostics(const SimulationDiagnostics *diag, int fd);
 
 #endif
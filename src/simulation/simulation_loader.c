@@ -0,0 +1,368 @@
+#include "simulation_loader.h"
+#include "body_data.h"
+#include "simulation_interface.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Fields per body in both formats: x, y, vx, vy, mass
+#define SIM_LOADER_FIELDS 5
+
+// Text chunks per thread, so uneven line lengths still balance
+#define SIM_LOADER_CHUNKS_PER_THREAD 4
+
+typedef struct TextChunk {
+  const char *begin, *end; // whole lines only
+  long first;              // index of the first body in this chunk
+  long count;              // bodies in this chunk
+  int error;               // set when a data line fails to parse
+} TextChunk;
+
+// Helper function prototypes
+BodyData *sim_load_binary(const char *map, size_t size, const char *path);
+
+BodyData *sim_load_text(const char *map, size_t size, const char *path);
+
+const char *sim_parse_float(const char *p, const char *end, float *out);
+
+const char *sim_skip_blanks(const char *p, const char *end);
+
+int sim_is_data_line(const char *p, const char *end);
+
+const char *sim_skip_header(const char *map, const char *end);
+
+BodyData *sim_load_bodies(const char *path, SimulationParams *params) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    fprintf(stderr, "%s: empty or unreadable file\n", path);
+    close(fd);
+    return NULL;
+  }
+
+  size_t size = st.st_size;
+  const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror(path);
+    return NULL;
+  }
+
+  // Every thread streams through its own part of the file
+  madvise((void *)map, size, MADV_WILLNEED);
+
+  BodyData *data;
+  if (size >= SIM_LOADER_HEADER_SIZE &&
+      memcmp(map, SIM_LOADER_MAGIC, 8) == 0) {
+    data = sim_load_binary(map, size, path);
+  } else {
+    data = sim_load_text(map, size, path);
+  }
+
+  munmap((void *)map, size);
+
+  if (data) {
+    params->body_count = data->count;
+  }
+
+  return data;
+}
+
+int sim_save_bodies(const BodyData *data, const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    perror(path);
+    return -1;
+  }
+
+  uint64_t count = data->count;
+  const float *fields[SIM_LOADER_FIELDS] = {data->x, data->y, data->vx,
+                                            data->vy, data->mass};
+
+  int ok = fwrite(SIM_LOADER_MAGIC, 1, 8, file) == 8 &&
+           fwrite(&count, sizeof(count), 1, file) == 1;
+  for (int f = 0; ok && f < SIM_LOADER_FIELDS; f++) {
+    ok = fwrite(fields[f], sizeof(float), count, file) == count;
+  }
+
+  if (fclose(file) != 0 || !ok) {
+    perror(path);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Helper functions
+BodyData *sim_load_binary(const char *map, size_t size, const char *path) {
+  uint64_t count;
+  memcpy(&count, map + 8, sizeof(count));
+
+  if (count == 0 || count > INT_MAX ||
+      size < SIM_LOADER_HEADER_SIZE +
+                 count * SIM_LOADER_FIELDS * sizeof(float)) {
+    fprintf(stderr, "%s: body count %llu does not match the file size\n",
+            path, (unsigned long long)count);
+    return NULL;
+  }
+
+  BodyData *data = body_data_create(count);
+  float *fields[SIM_LOADER_FIELDS] = {data->x, data->y, data->vx, data->vy,
+                                      data->mass};
+
+  // Straight from the mapping into each thread's own (first touched) range
+  #pragma omp parallel
+  {
+    int thread = omp_get_thread_num();
+    int thread_count = omp_get_num_threads();
+    size_t begin = count * thread / thread_count;
+    size_t end = count * (thread + 1) / thread_count;
+
+    for (int f = 0; f < SIM_LOADER_FIELDS; f++) {
+      const char *src =
+          map + SIM_LOADER_HEADER_SIZE + (f * count + begin) * sizeof(float);
+      memcpy(fields[f] + begin, src, (end - begin) * sizeof(float));
+    }
+  }
+
+  return data;
+}
+
+BodyData *sim_load_text(const char *map, size_t size, const char *path) {
+  const char *end = map + size;
+
+  // Past the header every line but blanks and comments has to parse
+  map = sim_skip_header(map, end);
+  size = end - map;
+
+  int chunk_count = omp_get_max_threads() * SIM_LOADER_CHUNKS_PER_THREAD;
+
+  TextChunk *chunks = malloc(chunk_count * sizeof(TextChunk));
+  if (!chunks) {
+    return NULL;
+  }
+
+  // Splitting on line boundaries
+  const char *begin = map;
+  for (int c = 0; c < chunk_count; c++) {
+    const char *chunk_end = map + size * (c + 1) / chunk_count;
+    if (chunk_end < begin) {
+      chunk_end = begin;
+    }
+    if (chunk_end > map && chunk_end < end && chunk_end[-1] != '\n') {
+      const char *newline = memchr(chunk_end, '\n', end - chunk_end);
+      chunk_end = newline ? newline + 1 : end;
+    }
+
+    chunks[c].begin = begin;
+    chunks[c].end = chunk_end;
+    chunks[c].error = 0;
+    begin = chunk_end;
+  }
+
+  // Pass 1: counting data lines
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (int c = 0; c < chunk_count; c++) {
+    long count = 0;
+    const char *line = chunks[c].begin;
+
+    while (line < chunks[c].end) {
+      const char *newline = memchr(line, '\n', chunks[c].end - line);
+      const char *line_end = newline ? newline : chunks[c].end;
+
+      count += sim_is_data_line(line, line_end);
+      line = line_end + 1;
+    }
+
+    chunks[c].count = count;
+  }
+
+  long total = 0;
+  for (int c = 0; c < chunk_count; c++) {
+    chunks[c].first = total;
+    total += chunks[c].count;
+  }
+
+  if (total == 0 || total > INT_MAX) {
+    fprintf(stderr, "%s: no bodies found\n", path);
+    free(chunks);
+    return NULL;
+  }
+
+  BodyData *data = body_data_create(total);
+  float *fields[SIM_LOADER_FIELDS] = {data->x, data->y, data->vx, data->vy,
+                                      data->mass};
+
+  // Pass 2: parsing straight into the body arrays
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (int c = 0; c < chunk_count; c++) {
+    long idx = chunks[c].first;
+    const char *line = chunks[c].begin;
+
+    while (line < chunks[c].end && !chunks[c].error) {
+      const char *newline = memchr(line, '\n', chunks[c].end - line);
+      const char *line_end = newline ? newline : chunks[c].end;
+
+      if (sim_is_data_line(line, line_end)) {
+        const char *p = line;
+        for (int f = 0; f < SIM_LOADER_FIELDS && p; f++) {
+          p = sim_parse_float(p, line_end, &fields[f][idx]);
+        }
+
+        // Missing, malformed (nan, inf, ...) or extra fields
+        if (!p || sim_skip_blanks(p, line_end) != line_end) {
+          chunks[c].error = 1;
+        }
+        idx++;
+      }
+
+      line = line_end + 1;
+    }
+  }
+
+  for (int c = 0; c < chunk_count; c++) {
+    if (chunks[c].error) {
+      fprintf(stderr, "%s: expected %d numbers per body line\n", path,
+              SIM_LOADER_FIELDS);
+      body_data_destroy(data);
+      data = NULL;
+      break;
+    }
+  }
+
+  free(chunks);
+  return data;
+}
+
+// Parses one number after any separators, bounded by end. Returns the
+// position after it or NULL when there is no number or it is not followed
+// by a separator or end.
+const char *sim_parse_float(const char *p, const char *end, float *out) {
+  static const double pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                 1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                 1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                 1e18, 1e19, 1e20, 1e21, 1e22};
+
+  p = sim_skip_blanks(p, end);
+
+  int negative = 0;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    p++;
+  }
+
+  double mantissa = 0;
+  int digits = 0, exp10 = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    mantissa = mantissa * 10 + (*p++ - '0');
+    digits++;
+  }
+  if (p < end && *p == '.') {
+    p++;
+    while (p < end && *p >= '0' && *p <= '9') {
+      mantissa = mantissa * 10 + (*p++ - '0');
+      exp10--;
+      digits++;
+    }
+  }
+
+  if (digits == 0) {
+    return NULL;
+  }
+
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    int exp_negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+      exp_negative = *p == '-';
+      p++;
+    }
+
+    int exp = 0, exp_digits = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+      if (exp < 1000)
+        exp = exp * 10 + (*p - '0');
+      p++;
+      exp_digits++;
+    }
+    if (exp_digits == 0) {
+      return NULL;
+    }
+    exp10 += exp_negative ? -exp : exp;
+  }
+
+  // Rejects 1-2, 1.5.3, 1x, ...
+  if (p < end && sim_skip_blanks(p, end) == p) {
+    return NULL;
+  }
+
+  double value;
+  if (exp10 >= 0 && exp10 <= 22) {
+    value = mantissa * pow10[exp10];
+  } else if (exp10 < 0 && exp10 >= -22) {
+    value = mantissa / pow10[-exp10];
+  } else {
+    value = mantissa * pow(10.0, exp10);
+  }
+
+  *out = negative ? -value : value;
+  return p;
+}
+
+// Skips field separators and trailing whitespace
+const char *sim_skip_blanks(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == ',' || *p == ';' ||
+                     *p == '\r')) {
+    p++;
+  }
+
+  return p;
+}
+
+// Every line holds a body except blank lines and # comments
+int sim_is_data_line(const char *p, const char *end) {
+  p = sim_skip_blanks(p, end);
+
+  return p < end && *p != '#';
+}
+
+// Returns the start of the line after the header, the first data line when
+// none of its fields starts like a number, or map when there is none
+const char *sim_skip_header(const char *map, const char *end) {
+  const char *line = map;
+
+  while (line < end) {
+    const char *newline = memchr(line, '\n', end - line);
+    const char *line_end = newline ? newline : end;
+
+    if (sim_is_data_line(line, line_end)) {
+      for (const char *p = line; p < line_end; p++) {
+        int field_start = p == line || p[-1] == ' ' || p[-1] == '\t' ||
+                          p[-1] == ',' || p[-1] == ';';
+        if (field_start && ((*p >= '0' && *p <= '9') || *p == '-' ||
+                            *p == '+' || *p == '.')) {
+          return map;
+        }
+      }
+
+      return newline ? newline + 1 : end;
+    }
+
+    line = line_end + 1;
+  }
+
+  return map;
+}
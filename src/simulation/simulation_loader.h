@@ -0,0 +1,22 @@
+#ifndef SIMULATION_LOADER_H
+#define SIMULATION_LOADER_H
+
+#include "body_data.h"
+#include "simulation_interface.h"
+
+// Raw binary initial conditions: the 8 magic bytes, a little endian uint64
+// body count, then count floats each of x, y, vx, vy and mass (SoA)
+#define SIM_LOADER_MAGIC "NBODYSOA"
+#define SIM_LOADER_HEADER_SIZE 16
+
+// Loads initial conditions from a raw binary (detected by its magic) or a
+// text file with one "x y vx vy mass" body per line (comma, semicolon or
+// whitespace separated, '#' comments and a header line allowed). The file
+// is mmapped and filled in parallel. Sets params->body_count, returns NULL
+// on failure.
+BodyData *sim_load_bodies(const char *path, SimulationParams *params);
+
+// Writes bodies in the raw binary format, returns 0 on success
+int sim_save_bodies(const BodyData *data, const char *path);
+
+#endif
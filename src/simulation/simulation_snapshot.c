@@ -0,0 +1,699 @@
+#include "simulation_snapshot.h"
+#include "simulation_core.h"
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Quantised coordinates stay within +-SNAP_MAX_Q so residuals fit 32 bits
+#define SNAP_MAX_Q ((1 << 30) - 1)
+
+// Unary prefixes this long switch to a raw 32 bit value
+#define SNAP_ESCAPE 32
+
+// Worst case encoded size of one block: escaped values (64 bits each) for
+// both axes, two Rice parameters, and slack for 64 bit reads past the end
+#define SNAP_BLOCK_BYTES (SNAP_BLOCK_SIZE * 2 * 8 + 16)
+
+typedef struct SnapBitWriter {
+  uint8_t *p;
+  uint64_t acc;
+  int bits;
+} SnapBitWriter;
+
+typedef struct SnapBitReader {
+  const uint8_t *p;
+  uint64_t acc;
+  int bits;
+} SnapBitReader;
+
+// Helper function prototypes
+SnapshotError snap_state_init(SnapshotState *state, int body_count);
+
+void snap_state_free(SnapshotState *state);
+
+void snap_order_bodies(SnapshotState *state, const float *x, const float *y,
+                       const QuadTreeNode *root);
+
+int snap_quantise(SnapshotState *state, const float *x, const float *y);
+
+void snap_shift_history(SnapshotState *state);
+
+uint32_t snap_encode_block(const SnapshotState *state, int block,
+                           uint8_t *out);
+
+void snap_decode_block(SnapshotState *state, int block, const uint8_t *in);
+
+SnapshotError snap_reader_decode(SnapshotReader *reader, int frame);
+
+SnapshotWriter *snap_writer_create(const char *path, int body_count,
+                                   float err_bound, int key_interval) {
+  if (body_count <= 0 || err_bound <= 0 || key_interval <= 0) {
+    return NULL;
+  }
+
+  SnapshotWriter *writer = malloc(sizeof(SnapshotWriter));
+  if (!writer) {
+    return NULL;
+  }
+
+  if (snap_state_init(&writer->state, body_count) != SNAP_SUCCESS) {
+    free(writer);
+    return NULL;
+  }
+
+  writer->file = fopen(path, "wb");
+  if (!writer->file) {
+    snap_state_free(&writer->state);
+    free(writer);
+    return NULL;
+  }
+
+  writer->err_bound = err_bound;
+  writer->key_interval = key_interval;
+  writer->frame_count = 0;
+  writer->need_key = 0;
+
+  SnapshotFileHeader header = {.body_count = body_count,
+                               .block_size = SNAP_BLOCK_SIZE,
+                               .err_bound = err_bound,
+                               .key_interval = key_interval};
+  memcpy(header.magic, SNAP_FILE_MAGIC, sizeof(header.magic));
+
+  if (fwrite(&header, sizeof(header), 1, writer->file) != 1) {
+    snap_writer_destroy(writer);
+    return NULL;
+  }
+
+  return writer;
+}
+
+SnapshotError snap_writer_push(SnapshotWriter *writer,
+                               const SimulationCore *core) {
+  if (!writer || !core) {
+    return SNAP_INVALID_POINTER;
+  }
+
+  SnapshotState *state = &writer->state;
+  const BodyData *bodies = core->bodies;
+  if (bodies->count != state->body_count) {
+    return SNAP_OUT_OF_RANGE;
+  }
+
+  int key = writer->need_key ||
+            writer->frame_count % writer->key_interval == 0;
+
+  // Until this push completes the coding state may be half updated, only a
+  // keyframe can follow a failure
+  writer->need_key = 1;
+  const QuadTreeNode *root = &core->qt->nodes[0];
+
+  // A body leaving the key grid's range forces an early keyframe
+  for (;;) {
+    if (key) {
+      state->frames_since_key = 0;
+      state->origin_x = root->s_x - 0.5f * root->size;
+      state->origin_y = root->s_y - 0.5f * root->size;
+
+      // Leaving room for rounding the decoded position back to float
+      float extent = fmaxf(fabsf(state->origin_x), fabsf(state->origin_y)) +
+                     root->size;
+      float slack = fminf(extent * FLT_EPSILON, 0.5f * writer->err_bound);
+      state->cell = 2 * (writer->err_bound - slack);
+      snap_order_bodies(state, bodies->x, bodies->y, root);
+    } else {
+      state->frames_since_key++;
+    }
+
+    if (!snap_quantise(state, bodies->x, bodies->y)) {
+      break;
+    }
+    if (key) {
+      return SNAP_OUT_OF_RANGE;
+    }
+    key = 1;
+  }
+
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (int i = 0; i < state->block_count; i++) {
+    state->block_sizes[i] =
+        snap_encode_block(state, i, state->payload + state->block_offsets[i]);
+  }
+
+  uint64_t payload_size = state->block_count * sizeof(uint32_t);
+  if (key) {
+    payload_size += state->body_count * sizeof(int32_t);
+  }
+  for (int i = 0; i < state->block_count; i++) {
+    payload_size += state->block_sizes[i];
+  }
+
+  SnapshotFrameHeader header = {.magic = SNAP_FRAME_MAGIC,
+                                .keyframe = key,
+                                .payload_size = payload_size,
+                                .time = core->time,
+                                .origin_x = state->origin_x,
+                                .origin_y = state->origin_y,
+                                .cell = state->cell,
+                                .block_count = state->block_count};
+
+  FILE *file = writer->file;
+  off_t frame_start = ftello(file);
+
+  int ok = frame_start >= 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+  ok = ok && fwrite(state->block_sizes, sizeof(uint32_t), state->block_count,
+                    file) == (size_t)state->block_count;
+  if (key) {
+    ok = ok && fwrite(state->order, sizeof(int32_t), state->body_count,
+                      file) == (size_t)state->body_count;
+  }
+  for (int i = 0; ok && i < state->block_count; i++) {
+    ok = fwrite(state->payload + state->block_offsets[i], 1,
+                state->block_sizes[i], file) == state->block_sizes[i];
+  }
+
+  if (!ok) {
+    // Cutting off the partial frame so the next one follows a complete one
+    if (frame_start >= 0) {
+      fflush(file);
+      clearerr(file);
+      if (ftruncate(fileno(file), frame_start) == 0) {
+        fseeko(file, frame_start, SEEK_SET);
+      }
+    }
+    return SNAP_IO_FAILURE;
+  }
+
+  snap_shift_history(state);
+  writer->frame_count++;
+  writer->need_key = 0;
+
+  return SNAP_SUCCESS;
+}
+
+SnapshotError snap_writer_destroy(SnapshotWriter *writer) {
+  if (!writer) {
+    return SNAP_INVALID_POINTER;
+  }
+
+  SnapshotError err = SNAP_SUCCESS;
+  if (writer->file && fclose(writer->file) != 0) {
+    err = SNAP_IO_FAILURE;
+  }
+
+  snap_state_free(&writer->state);
+  free(writer);
+
+  return err;
+}
+
+SnapshotReader *snap_reader_open(const char *path) {
+  SnapshotReader *reader = calloc(1, sizeof(SnapshotReader));
+  if (!reader) {
+    return NULL;
+  }
+
+  reader->file = fopen(path, "rb");
+  if (!reader->file) {
+    free(reader);
+    return NULL;
+  }
+
+  SnapshotFileHeader *header = &reader->header;
+  if (fread(header, sizeof(*header), 1, reader->file) != 1 ||
+      memcmp(header->magic, SNAP_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->block_size != SNAP_BLOCK_SIZE || header->body_count <= 0 ||
+      snap_state_init(&reader->state, header->body_count) != SNAP_SUCCESS) {
+    fclose(reader->file);
+    free(reader);
+    return NULL;
+  }
+
+  reader->scan_offset = sizeof(*header);
+  reader->decoded_frame = -1;
+
+  if (snap_reader_refresh(reader) != SNAP_SUCCESS) {
+    snap_reader_close(reader);
+    return NULL;
+  }
+
+  return reader;
+}
+
+// Indexes frames appended since the last scan (the writer may still be
+// running); a partially written frame is left for the next refresh
+SnapshotError snap_reader_refresh(SnapshotReader *reader) {
+  if (!reader) {
+    return SNAP_INVALID_POINTER;
+  }
+
+  FILE *file = reader->file;
+  if (fseeko(file, 0, SEEK_END) != 0) {
+    return SNAP_IO_FAILURE;
+  }
+  uint64_t file_size = ftello(file);
+
+  while (reader->scan_offset + sizeof(SnapshotFrameHeader) <= file_size) {
+    SnapshotFrameHeader header;
+    if (fseeko(file, reader->scan_offset, SEEK_SET) != 0 ||
+        fread(&header, sizeof(header), 1, file) != 1) {
+      return SNAP_IO_FAILURE;
+    }
+
+    if (header.magic != SNAP_FRAME_MAGIC ||
+        (reader->frame_count == 0 && !header.keyframe)) {
+      return SNAP_INVALID_FILE;
+    }
+
+    uint64_t next = reader->scan_offset + sizeof(header) + header.payload_size;
+    if (next > file_size) {
+      break;
+    }
+
+    // Check to see if we will be over capacity
+    if (reader->frame_count + 1 > reader->frame_capacity) {
+      int capacity = reader->frame_capacity ? 2 * reader->frame_capacity : 64;
+
+      uint64_t *offsets =
+          realloc(reader->frame_offsets, capacity * sizeof(uint64_t));
+      if (!offsets) {
+        return SNAP_ALLOC_FAILURE;
+      }
+      reader->frame_offsets = offsets;
+
+      uint8_t *keyframes = realloc(reader->keyframes, capacity);
+      if (!keyframes) {
+        return SNAP_ALLOC_FAILURE;
+      }
+      reader->keyframes = keyframes;
+
+      reader->frame_capacity = capacity;
+    }
+
+    reader->frame_offsets[reader->frame_count] = reader->scan_offset;
+    reader->keyframes[reader->frame_count] = header.keyframe != 0;
+    reader->frame_count++;
+    reader->scan_offset = next;
+  }
+
+  return SNAP_SUCCESS;
+}
+
+SnapshotError snap_reader_read(SnapshotReader *reader, int frame, float *x,
+                               float *y, float *time) {
+  if (!reader) {
+    return SNAP_INVALID_POINTER;
+  }
+
+  if (frame >= reader->frame_count) {
+    SnapshotError err = snap_reader_refresh(reader);
+    if (err != SNAP_SUCCESS) {
+      return err;
+    }
+  }
+  if (frame < 0 || frame >= reader->frame_count) {
+    return SNAP_OUT_OF_RANGE;
+  }
+
+  // Decoding forward from the closest keyframe, or from the frame already
+  // held when it lies in between (sequential reads decode one frame)
+  int key = frame;
+  while (!reader->keyframes[key]) {
+    key--;
+  }
+
+  int start = key;
+  if (reader->decoded_frame >= key && reader->decoded_frame <= frame) {
+    start = reader->decoded_frame + 1;
+  }
+
+  for (int f = start; f <= frame; f++) {
+    SnapshotError err = snap_reader_decode(reader, f);
+    if (err != SNAP_SUCCESS) {
+      reader->decoded_frame = -1;
+      return err;
+    }
+  }
+
+  // The decoded frame has been shifted into prev
+  SnapshotState *state = &reader->state;
+  double origin_x = state->origin_x, origin_y = state->origin_y;
+  double cell = state->cell;
+
+  #pragma omp parallel for schedule(static)
+  for (int k = 0; k < state->body_count; k++) {
+    int i = state->order[k];
+    x[i] = origin_x + state->prev_x[k] * cell;
+    y[i] = origin_y + state->prev_y[k] * cell;
+  }
+
+  if (time) {
+    *time = reader->decoded_time;
+  }
+
+  return SNAP_SUCCESS;
+}
+
+void snap_reader_close(SnapshotReader *reader) {
+  if (reader) {
+    fclose(reader->file);
+    free(reader->frame_offsets);
+    free(reader->keyframes);
+    snap_state_free(&reader->state);
+    free(reader);
+  }
+}
+
+// Helper functions
+SnapshotError snap_state_init(SnapshotState *state, int body_count) {
+  state->body_count = body_count;
+  state->block_count = (body_count + SNAP_BLOCK_SIZE - 1) / SNAP_BLOCK_SIZE;
+  state->frames_since_key = 0;
+  state->origin_x = state->origin_y = 0;
+  state->cell = 1;
+
+  size_t q_size = body_count * sizeof(int32_t);
+  state->order = malloc(q_size);
+  state->qx = malloc(q_size);
+  state->qy = malloc(q_size);
+  state->prev_x = malloc(q_size);
+  state->prev_y = malloc(q_size);
+  state->prev2_x = malloc(q_size);
+  state->prev2_y = malloc(q_size);
+
+  state->payload = malloc((size_t)state->block_count * SNAP_BLOCK_BYTES);
+  state->block_offsets = malloc(state->block_count * sizeof(uint64_t));
+  state->block_sizes = malloc(state->block_count * sizeof(uint32_t));
+
+  if (!state->order || !state->qx || !state->qy || !state->prev_x ||
+      !state->prev_y || !state->prev2_x || !state->prev2_y ||
+      !state->payload || !state->block_offsets || !state->block_sizes) {
+    snap_state_free(state);
+    return SNAP_ALLOC_FAILURE;
+  }
+
+  // Writer layout, every block gets its worst case size
+  for (int i = 0; i < state->block_count; i++) {
+    state->block_offsets[i] = (uint64_t)i * SNAP_BLOCK_BYTES;
+  }
+
+  return SNAP_SUCCESS;
+}
+
+void snap_state_free(SnapshotState *state) {
+  free(state->order);
+  free(state->qx);
+  free(state->qy);
+  free(state->prev_x);
+  free(state->prev_y);
+  free(state->prev2_x);
+  free(state->prev2_y);
+  free(state->payload);
+  free(state->block_offsets);
+  free(state->block_sizes);
+  memset(state, 0, sizeof(*state));
+}
+
+static inline uint32_t snap_spread_bits(uint32_t v) {
+  v = (v | (v << 8)) & 0x00ff00ffu;
+  v = (v | (v << 4)) & 0x0f0f0f0fu;
+  v = (v | (v << 2)) & 0x33333333u;
+  v = (v | (v << 1)) & 0x55555555u;
+  return v;
+}
+
+static int snap_compare_keys(const void *a, const void *b) {
+  uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+  return (ka > kb) - (ka < kb);
+}
+
+// Sorts bodies along a Morton curve over the root square (16 bits per axis)
+void snap_order_bodies(SnapshotState *state, const float *x, const float *y,
+                       const QuadTreeNode *root) {
+  int n = state->body_count;
+  uint64_t *keys = malloc(n * sizeof(uint64_t));
+
+  float scale = root->size > 0 ? 65536.0f / root->size : 0;
+  float min_x = root->s_x - 0.5f * root->size;
+  float min_y = root->s_y - 0.5f * root->size;
+
+  if (!keys) {
+    // Falling back to index order, still correct, just compresses worse
+    for (int i = 0; i < n; i++) {
+      state->order[i] = i;
+    }
+    return;
+  }
+
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < n; i++) {
+    float fx = (x[i] - min_x) * scale;
+    float fy = (y[i] - min_y) * scale;
+    uint32_t cx = fx < 0 ? 0 : (fx > 65535 ? 65535 : (uint32_t)fx);
+    uint32_t cy = fy < 0 ? 0 : (fy > 65535 ? 65535 : (uint32_t)fy);
+
+    uint64_t morton = snap_spread_bits(cx) | (snap_spread_bits(cy) << 1);
+    keys[i] = (morton << 32) | (uint32_t)i;
+  }
+
+  qsort(keys, n, sizeof(uint64_t), snap_compare_keys);
+
+  #pragma omp parallel for schedule(static)
+  for (int k = 0; k < n; k++) {
+    state->order[k] = (int32_t)(keys[k] & 0xffffffffu);
+  }
+
+  free(keys);
+}
+
+// Returns non zero when a position falls outside the grid's range
+int snap_quantise(SnapshotState *state, const float *x, const float *y) {
+  double origin_x = state->origin_x, origin_y = state->origin_y;
+  double inv_cell = 1.0 / state->cell;
+  int overflow = 0;
+
+  #pragma omp parallel for schedule(static) reduction(| : overflow)
+  for (int k = 0; k < state->body_count; k++) {
+    int i = state->order[k];
+    double qx = rint((x[i] - origin_x) * inv_cell);
+    double qy = rint((y[i] - origin_y) * inv_cell);
+
+    if (fabs(qx) > SNAP_MAX_Q || fabs(qy) > SNAP_MAX_Q) {
+      overflow = 1;
+    } else {
+      state->qx[k] = (int32_t)qx;
+      state->qy[k] = (int32_t)qy;
+    }
+  }
+
+  return overflow;
+}
+
+// prev2 <- prev <- current, recycling the oldest arrays for the next frame
+void snap_shift_history(SnapshotState *state) {
+  int32_t *tmp_x = state->prev2_x, *tmp_y = state->prev2_y;
+
+  state->prev2_x = state->prev_x;
+  state->prev2_y = state->prev_y;
+  state->prev_x = state->qx;
+  state->prev_y = state->qy;
+  state->qx = tmp_x;
+  state->qy = tmp_y;
+}
+
+// Keyframes predict from the previous body along the curve (restarting at
+// each block), the first frame after a key from the previous frame, later
+// frames by linear extrapolation of the previous two
+static inline int64_t snap_predict(const SnapshotState *state,
+                                   const int32_t *q, const int32_t *prev,
+                                   const int32_t *prev2, int k, int begin) {
+  if (state->frames_since_key == 0) {
+    return k > begin ? q[k - 1] : 0;
+  }
+  if (state->frames_since_key == 1) {
+    return prev[k];
+  }
+
+  int64_t pred = 2 * (int64_t)prev[k] - prev2[k];
+  if (pred > SNAP_MAX_Q)
+    pred = SNAP_MAX_Q;
+  if (pred < -SNAP_MAX_Q)
+    pred = -SNAP_MAX_Q;
+
+  return pred;
+}
+
+static inline void snap_put_bits(SnapBitWriter *w, uint64_t value, int n) {
+  w->acc |= value << w->bits;
+  w->bits += n;
+  while (w->bits >= 8) {
+    *w->p++ = (uint8_t)w->acc;
+    w->acc >>= 8;
+    w->bits -= 8;
+  }
+}
+
+static inline uint64_t snap_get_bits(SnapBitReader *r, int n) {
+  while (r->bits < n) {
+    r->acc |= (uint64_t)*r->p++ << r->bits;
+    r->bits += 8;
+  }
+
+  uint64_t value = r->acc & ((1ull << n) - 1);
+  r->acc >>= n;
+  r->bits -= n;
+
+  return value;
+}
+
+uint32_t snap_encode_block(const SnapshotState *state, int block,
+                           uint8_t *out) {
+  int begin = block * SNAP_BLOCK_SIZE;
+  int end = begin + SNAP_BLOCK_SIZE;
+  if (end > state->body_count)
+    end = state->body_count;
+
+  SnapBitWriter w = {out, 0, 0};
+
+  for (int axis = 0; axis < 2; axis++) {
+    const int32_t *q = axis ? state->qy : state->qx;
+    const int32_t *prev = axis ? state->prev_y : state->prev_x;
+    const int32_t *prev2 = axis ? state->prev2_y : state->prev2_x;
+
+    // Rice parameter: smallest k with count * 2^k >= sum of residuals
+    uint64_t sum = 0;
+    for (int k = begin; k < end; k++) {
+      int64_t d = q[k] - snap_predict(state, q, prev, prev2, k, begin);
+      sum += d >= 0 ? 2 * d : -2 * d - 1;
+    }
+
+    int rice = 0;
+    while (rice < 31 && ((uint64_t)(end - begin) << rice) < sum) {
+      rice++;
+    }
+    snap_put_bits(&w, rice, 5);
+
+    for (int k = begin; k < end; k++) {
+      int64_t d = q[k] - snap_predict(state, q, prev, prev2, k, begin);
+      uint32_t u = d >= 0 ? 2 * d : -2 * d - 1; // zigzag
+
+      uint32_t quotient = u >> rice;
+      if (quotient < SNAP_ESCAPE) {
+        // quotient ones, a zero, then the low bits
+        snap_put_bits(&w, (1ull << quotient) - 1, quotient + 1);
+        snap_put_bits(&w, u & ((1ull << rice) - 1), rice);
+      } else {
+        snap_put_bits(&w, 0xffffffffu, SNAP_ESCAPE);
+        snap_put_bits(&w, u, 32);
+      }
+    }
+  }
+
+  if (w.bits > 0) {
+    *w.p++ = (uint8_t)w.acc;
+  }
+
+  return w.p - out;
+}
+
+void snap_decode_block(SnapshotState *state, int block, const uint8_t *in) {
+  int begin = block * SNAP_BLOCK_SIZE;
+  int end = begin + SNAP_BLOCK_SIZE;
+  if (end > state->body_count)
+    end = state->body_count;
+
+  SnapBitReader r = {in, 0, 0};
+
+  for (int axis = 0; axis < 2; axis++) {
+    int32_t *q = axis ? state->qy : state->qx;
+    const int32_t *prev = axis ? state->prev_y : state->prev_x;
+    const int32_t *prev2 = axis ? state->prev2_y : state->prev2_x;
+
+    int rice = snap_get_bits(&r, 5);
+
+    for (int k = begin; k < end; k++) {
+      uint32_t quotient = 0;
+      while (quotient < SNAP_ESCAPE && snap_get_bits(&r, 1)) {
+        quotient++;
+      }
+
+      uint32_t u;
+      if (quotient < SNAP_ESCAPE) {
+        u = (quotient << rice) | snap_get_bits(&r, rice);
+      } else {
+        u = snap_get_bits(&r, 32);
+      }
+
+      int64_t d = (u >> 1) ^ -(int64_t)(u & 1);
+      q[k] = d + snap_predict(state, q, prev, prev2, k, begin);
+    }
+  }
+}
+
+SnapshotError snap_reader_decode(SnapshotReader *reader, int frame) {
+  SnapshotState *state = &reader->state;
+  FILE *file = reader->file;
+
+  SnapshotFrameHeader header;
+  if (fseeko(file, reader->frame_offsets[frame], SEEK_SET) != 0 ||
+      fread(&header, sizeof(header), 1, file) != 1) {
+    return SNAP_IO_FAILURE;
+  }
+
+  if (header.block_count != (uint32_t)state->block_count) {
+    return SNAP_INVALID_FILE;
+  }
+
+  if (header.keyframe) {
+    state->frames_since_key = 0;
+  } else {
+    state->frames_since_key++;
+  }
+  state->origin_x = header.origin_x;
+  state->origin_y = header.origin_y;
+  state->cell = header.cell;
+
+  uint64_t data_size = header.payload_size;
+  if (fread(state->block_sizes, sizeof(uint32_t), state->block_count,
+            file) != (size_t)state->block_count) {
+    return SNAP_IO_FAILURE;
+  }
+  data_size -= state->block_count * sizeof(uint32_t);
+
+  if (header.keyframe) {
+    if (fread(state->order, sizeof(int32_t), state->body_count, file) !=
+        (size_t)state->body_count) {
+      return SNAP_IO_FAILURE;
+    }
+    data_size -= state->body_count * sizeof(int32_t);
+  }
+
+  // Blocks are stored back to back
+  uint64_t offset = 0;
+  for (int i = 0; i < state->block_count; i++) {
+    if (state->block_sizes[i] > SNAP_BLOCK_BYTES - 16) {
+      return SNAP_INVALID_FILE;
+    }
+    state->block_offsets[i] = offset;
+    offset += state->block_sizes[i];
+  }
+
+  if (offset != data_size ||
+      fread(state->payload, 1, data_size, file) != data_size) {
+    return SNAP_INVALID_FILE;
+  }
+  memset(state->payload + data_size, 0, 16);
+
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (int i = 0; i < state->block_count; i++) {
+    snap_decode_block(state, i, state->payload + state->block_offsets[i]);
+  }
+
+  snap_shift_history(state);
+  reader->decoded_frame = frame;
+  reader->decoded_time = header.time;
+
+  return SNAP_SUCCESS;
+}
@@ -0,0 +1,108 @@
+#ifndef SIMULATION_SNAPSHOT_H
+#define SIMULATION_SNAPSHOT_H
+
+#include "simulation_core.h"
+#include <stdint.h>
+#include <stdio.h>
+
+// Compressed trajectory stream. Positions are quantised on a grid anchored
+// at the tree root with spacing 2 * (err_bound - slack), where slack covers
+// rounding the decoded position back to float, so every coordinate comes
+// back within err_bound. Keyframes put the bodies in Morton order over the
+// root square and store spatial deltas. Frames in between store temporal
+// residuals against a linear prediction from the two previous frames. The
+// residuals are Rice coded in independent blocks, and blocks are encoded
+// and decoded in parallel.
+
+#define SNAP_FILE_MAGIC "NBSNAP01"
+#define SNAP_FRAME_MAGIC 0x4d415246u // "FRAM"
+
+// Bodies per independently coded block
+#define SNAP_BLOCK_SIZE 4096
+
+typedef enum SnapshotError {
+  SNAP_SUCCESS,
+  SNAP_ALLOC_FAILURE,
+  SNAP_IO_FAILURE,
+  SNAP_INVALID_POINTER,
+  SNAP_INVALID_FILE,
+  SNAP_OUT_OF_RANGE,
+} SnapshotError;
+
+typedef struct SnapshotFileHeader {
+  char magic[8];        // SNAP_FILE_MAGIC
+  int32_t body_count;
+  int32_t block_size;   // SNAP_BLOCK_SIZE when written
+  float err_bound;      // max absolute position error
+  int32_t key_interval; // frames between keyframes
+} SnapshotFileHeader;
+
+typedef struct SnapshotFrameHeader {
+  uint32_t magic;          // SNAP_FRAME_MAGIC
+  uint32_t keyframe;       // 1 when the frame starts a new key interval
+  uint64_t payload_size;   // bytes following this header
+  float time;              // simulation time
+  float origin_x, origin_y; // grid origin (root square corner at the key)
+  float cell;              // grid spacing
+  uint32_t block_count;
+  uint32_t reserved;
+} SnapshotFrameHeader;
+
+// Coding state shared by the writer and the reader
+typedef struct SnapshotState {
+  int body_count;
+  int block_count;
+  int frames_since_key; // 0 on a keyframe
+  float origin_x, origin_y, cell;
+
+  int32_t *order;             // body index at each Morton position
+  int32_t *qx, *qy;           // quantised positions (Morton order)
+  int32_t *prev_x, *prev_y;   // previous frame
+  int32_t *prev2_x, *prev2_y; // frame before that
+
+  uint8_t *payload;          // encoded blocks of the current frame
+  uint64_t *block_offsets;   // start of each block in payload
+  uint32_t *block_sizes;     // encoded bytes per block
+} SnapshotState;
+
+typedef struct SnapshotWriter {
+  FILE *file;
+  float err_bound;
+  int key_interval;
+  int frame_count;
+  int need_key; // set by a failed push, the coding state is then stale
+  SnapshotState state;
+} SnapshotWriter;
+
+typedef struct SnapshotReader {
+  FILE *file;
+  SnapshotFileHeader header;
+
+  uint64_t *frame_offsets; // file offset of every frame header
+  uint8_t *keyframes;      // keyframe flag of every frame
+  int frame_count;
+  int frame_capacity;
+  uint64_t scan_offset;    // where snap_reader_refresh resumes
+
+  int decoded_frame;       // frame held in state, -1 for none
+  float decoded_time;
+  SnapshotState state;
+} SnapshotReader;
+
+// Writer: one frame per push, quantised against the root square of the
+// core's tree (set by the last sim_core_step or sim_core_init_leapfrog). A
+// failed push leaves the file ending at the last complete frame.
+SnapshotWriter *snap_writer_create(const char *path, int body_count,
+                                   float err_bound, int key_interval);
+SnapshotError snap_writer_push(SnapshotWriter *writer,
+                               const SimulationCore *core);
+SnapshotError snap_writer_destroy(SnapshotWriter *writer);
+
+// Reader: random access by frame, sequential reads decode one frame each
+SnapshotReader *snap_reader_open(const char *path);
+SnapshotError snap_reader_refresh(SnapshotReader *reader);
+SnapshotError snap_reader_read(SnapshotReader *reader, int frame, float *x,
+                               float *y, float *time);
+void snap_reader_close(SnapshotReader *reader);
+
+#endif